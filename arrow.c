@@ -0,0 +1,1067 @@
+/*
+ * Arrow IPC output (format=arrow).
+ *
+ * Rows are appended to per-relation columnar builders and flushed at commit,
+ * or as soon as a relation has arrow-batch-rows buffered rows. Every flush
+ * writes one message per relation holding a complete Arrow IPC stream: the
+ * schema, one record batch and the end-of-stream marker. The table name is
+ * in the schema's custom metadata under "table".
+ *
+ * The columns are the change type, the optional commit timestamp, xid and
+ * LSN fields, a nullable struct with the old key and one nullable column per table
+ * column. Values are stored in the host byte order, which the schema
+ * declares; the flatbuffer metadata is always little-endian.
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+
+#include "nodes/pg_list.h"
+
+#include "utils/memutils.h"
+
+#include "json_decoding_internal.h"
+
+#define ARROW_METADATA_V5 4
+
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+
+#define ARROW_TYPE_ID_INT 2
+#define ARROW_TYPE_ID_FLOATING_POINT 3
+#define ARROW_TYPE_ID_BINARY 4
+#define ARROW_TYPE_ID_UTF8 5
+#define ARROW_TYPE_ID_BOOL 6
+#define ARROW_TYPE_ID_TIMESTAMP 10
+#define ARROW_TYPE_ID_STRUCT 13
+
+#define ARROW_PRECISION_SINGLE 1
+#define ARROW_PRECISION_DOUBLE 2
+
+#define ARROW_TIME_UNIT_MICROSECOND 2
+
+#ifdef WORDS_BIGENDIAN
+#define ARROW_ENDIANNESS 1
+#else
+#define ARROW_ENDIANNESS 0
+#endif
+
+#define ARROW_MAX_TABLE_FIELDS 7
+
+typedef enum {
+    ARROW_BOOL,
+    ARROW_INT16,
+    ARROW_INT32,
+    ARROW_INT64,
+    ARROW_UINT32,
+    ARROW_UINT64,
+    ARROW_FLOAT32,
+    ARROW_FLOAT64,
+    ARROW_TIMESTAMP,
+    ARROW_TIMESTAMPTZ,
+    ARROW_UTF8,
+    ARROW_BINARY,
+    ARROW_STRUCT
+} ArrowType;
+
+/*
+ * Builder for one column. Table columns copy what they need from the
+ * relation plan, so a batch stays usable after the plan is rebuilt.
+ */
+typedef struct ArrowColumn {
+    char *name;
+    ArrowType type;
+    int attnum;
+    JsonDecodingColumnKind kind;
+    Oid typoutput;
+    bool typisvarlena;
+    StringInfoData validity;
+    StringInfoData values;
+    StringInfoData offsets;
+    int64 null_count;
+    int nchildren;
+    struct ArrowColumn *children;
+} ArrowColumn;
+
+typedef struct {
+    Oid relid;
+    uint32 generation;
+    /* the relation's cache entry, which outlives plan rebuilds; for relation-stats */
+    JsonDecodingRelation *relinfo;
+    MemoryContext context;
+    char *table_name;
+    int64 nrows;
+    /* size of the buffered rows, counted into arrow_buffered_bytes */
+    int64 bytes;
+    int ncolumns;
+    ArrowColumn *columns;
+} ArrowBatch;
+
+/*
+ * Helper Methods.
+ */
+static ArrowBatch *get_batch(LogicalDecodingContext *ctx, JsonDecodingData *data, JsonDecodingRelation *relinfo);
+
+static ArrowBatch *create_batch(JsonDecodingData *data, JsonDecodingRelation *relinfo);
+
+static void init_table_columns(ArrowColumn *columns, JsonDecodingRelation *relinfo);
+
+static int count_table_columns(JsonDecodingRelation *relinfo);
+
+static void flush_batch(LogicalDecodingContext *ctx, ArrowBatch *batch);
+
+static void column_init(ArrowColumn *column, const char *name, ArrowType type);
+
+static void column_reset(ArrowColumn *column);
+
+static void column_append_null(ArrowColumn *column, int64 index);
+
+static void column_append_fixed(ArrowColumn *column, int64 index, const void *value, int width);
+
+static void column_append_bytes(ArrowColumn *column, int64 index, const char *value, int len);
+
+static void column_append_datum(ArrowColumn *column, int64 index, Datum value);
+
+static void append_tuple(ArrowColumn *columns,
+                         int ncolumns,
+                         JsonDecodingData *data,
+                         JsonDecodingRelation *relinfo,
+                         TupleDesc tupdesc,
+                         HeapTuple tuple,
+                         int64 index);
+
+static void bitmap_append(StringInfo bitmap, int64 index, bool bit);
+
+static void write_message(StringInfo s, ArrowBatch *batch, bool schema);
+
+static int write_schema(StringInfo s, int base, ArrowBatch *batch);
+
+static int write_field_vector(StringInfo s, int base, ArrowColumn *columns, int ncolumns);
+
+static int write_field(StringInfo s, int base, ArrowColumn *column);
+
+static int write_type(StringInfo s, int base, ArrowType type);
+
+static int write_record_batch(StringInfo s, int base, ArrowBatch *batch, int64 *body_length);
+
+static int count_nodes(ArrowColumn *columns, int ncolumns);
+
+static int column_buffers(ArrowColumn *column, StringInfo *buffers);
+
+static int count_buffers(ArrowColumn *columns, int ncolumns);
+
+static int64 columns_bytes(ArrowColumn *columns, int ncolumns);
+
+static void append_nodes(StringInfo s, ArrowColumn *columns, int ncolumns, int64 nrows);
+
+static void append_buffer_specs(StringInfo s, ArrowColumn *columns, int ncolumns, int64 *offset);
+
+static void append_body(StringInfo s, ArrowColumn *columns, int ncolumns);
+
+static int fb_table(StringInfo s, int base, int nfields, const int *sizes, int *positions);
+
+static int fb_vector(StringInfo s, int base, int count, int element_size);
+
+static int fb_string(StringInfo s, int base, const char *value);
+
+static void fb_link(StringInfo s, int position, int target);
+
+static void fb_pad(StringInfo s, int base, int alignment);
+
+static void append_u16(StringInfo s, uint16 value);
+
+static void append_u32(StringInfo s, uint32 value);
+
+static void append_u64(StringInfo s, uint64 value);
+
+static void put_le(StringInfo s, int position, uint64 value, int width);
+
+/*
+ * Implementation.
+ */
+
+void arrow_append_change(LogicalDecodingContext *ctx,
+                         JsonDecodingData *data,
+                         JsonDecodingRelation *relinfo,
+                         TupleDesc tupdesc,
+                         ReorderBufferTXN *txn,
+                         ReorderBufferChange *change) {
+    HeapTuple oldtuple = change->data.tp.oldtuple != NULL ? &change->data.tp.oldtuple->tuple : NULL;
+    HeapTuple newtuple = change->data.tp.newtuple != NULL ? &change->data.tp.newtuple->tuple : NULL;
+    ArrowBatch *batch = get_batch(ctx, data, relinfo);
+    ArrowColumn *column = batch->columns;
+    int64 index = batch->nrows;
+    int64 value;
+    int64 bytes;
+    uint64 lsn;
+    uint64 lag;
+
+    column_append_bytes(column++, index, change_type_name(change->action), strlen(change_type_name(change->action)));
+
+    if (data->include_timestamp) {
+        value = timestamp_to_unix_micros(TXN_COMMIT_TIME(txn));
+        column_append_fixed(column++, index, &value, sizeof(int64));
+    }
+
+    if (data->include_xids) {
+        column_append_fixed(column++, index, &txn->xid, sizeof(uint32));
+    }
+
+    if (data->include_lsn) {
+        lsn = change->lsn;
+        column_append_fixed(column++, index, &lsn, sizeof(uint64));
+        lsn = txn->final_lsn;
+        column_append_fixed(column++, index, &lsn, sizeof(uint64));
+        value = data->xact_changes;
+        column_append_fixed(column++, index, &value, sizeof(int64));
+    }
+
+    if (data->include_decode_lag) {
+        lag = decode_lag_ms(txn);
+        column_append_fixed(column++, index, &lag, sizeof(uint64));
+    }
+
+    if (change->action == REORDER_BUFFER_CHANGE_UPDATE && oldtuple != NULL) {
+        bitmap_append(&column->validity, index, true);
+        append_tuple(column->children, column->nchildren, data, relinfo, tupdesc, oldtuple, index);
+    } else {
+        column_append_null(column, index);
+    }
+    column++;
+
+    append_tuple(column, batch->ncolumns - (column - batch->columns), data, relinfo, tupdesc,
+                 change->action == REORDER_BUFFER_CHANGE_DELETE ? oldtuple : newtuple, index);
+
+    batch->nrows++;
+
+    bytes = columns_bytes(batch->columns, batch->ncolumns);
+    data->arrow_buffered_bytes += bytes - batch->bytes;
+    batch->bytes = bytes;
+
+    if (data->arrow_batch_rows > 0 && batch->nrows >= data->arrow_batch_rows) {
+        flush_batch(ctx, batch);
+    }
+}
+
+/*
+ * Write out every relation buffered in the transaction.
+ */
+void arrow_flush(LogicalDecodingContext *ctx, JsonDecodingData *data) {
+    ListCell *cell;
+
+    foreach(cell, data->arrow_batches)
+    {
+        flush_batch(ctx, lfirst(cell));
+    }
+
+    data->arrow_batches = NIL;
+    MemoryContextReset(data->arrow_context);
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * A batch built from an older plan of the relation is flushed and replaced,
+ * so every record batch has a single schema.
+ */
+static ArrowBatch *get_batch(LogicalDecodingContext *ctx, JsonDecodingData *data, JsonDecodingRelation *relinfo) {
+    ArrowBatch *batch;
+    ListCell *cell;
+    MemoryContext old;
+
+    foreach(cell, data->arrow_batches)
+    {
+        batch = lfirst(cell);
+
+        if (batch->relid != relinfo->relid) {
+            continue;
+        }
+
+        if (batch->generation != relinfo->generation) {
+            flush_batch(ctx, batch);
+            MemoryContextDelete(batch->context);
+            batch = create_batch(data, relinfo);
+            lfirst(cell) = batch;
+        }
+
+        return batch;
+    }
+
+    batch = create_batch(data, relinfo);
+
+    old = MemoryContextSwitchTo(data->arrow_context);
+    data->arrow_batches = lappend(data->arrow_batches, batch);
+    MemoryContextSwitchTo(old);
+
+    return batch;
+}
+
+static ArrowBatch *create_batch(JsonDecodingData *data, JsonDecodingRelation *relinfo) {
+    MemoryContext context;
+    MemoryContext old;
+    ArrowBatch *batch;
+    ArrowColumn *column;
+    int ntable_columns = count_table_columns(relinfo);
+
+    context = AllocSetContextCreate(data->arrow_context, "json decoding arrow batch", ALLOCSET_DEFAULT_SIZES);
+    old = MemoryContextSwitchTo(context);
+
+    batch = palloc0(sizeof(ArrowBatch));
+    batch->relid = relinfo->relid;
+    batch->generation = relinfo->generation;
+    batch->relinfo = relinfo;
+    batch->context = context;
+    batch->table_name = pstrdup(relinfo->table_name);
+    batch->ncolumns = 2 + (data->include_timestamp ? 1 : 0) + (data->include_xids ? 1 : 0) +
+                     (data->include_lsn ? 3 : 0) + (data->include_decode_lag ? 1 : 0) + ntable_columns;
+    batch->columns = palloc0(sizeof(ArrowColumn) * batch->ncolumns);
+
+    column = batch->columns;
+    column_init(column++, data->key_type, ARROW_UTF8);
+    if (data->include_timestamp) {
+        column_init(column++, data->key_timestamp, ARROW_TIMESTAMPTZ);
+    }
+    if (data->include_xids) {
+        column_init(column++, data->key_xid, ARROW_UINT32);
+    }
+    if (data->include_lsn) {
+        column_init(column++, KEY_LSN, ARROW_UINT64);
+        column_init(column++, KEY_COMMIT_LSN, ARROW_UINT64);
+        column_init(column++, KEY_SEQ, ARROW_INT64);
+    }
+    if (data->include_decode_lag) {
+        column_init(column++, KEY_DECODE_LAG, ARROW_UINT64);
+    }
+
+    column_init(column, data->key_old_primary_key, ARROW_STRUCT);
+    column->nchildren = ntable_columns;
+    column->children = palloc0(sizeof(ArrowColumn) * Max(ntable_columns, 1));
+    init_table_columns(column->children, relinfo);
+    column++;
+
+    init_table_columns(column, relinfo);
+
+    MemoryContextSwitchTo(old);
+
+    return batch;
+}
+
+static void init_table_columns(ArrowColumn *columns, JsonDecodingRelation *relinfo) {
+    int natt;
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *plan = &relinfo->columns[natt];
+        ArrowType type;
+
+        if (plan->skip) {
+            continue;
+        }
+
+        switch (plan->kind) {
+            case COLUMN_KIND_BOOL:
+                type = ARROW_BOOL;
+                break;
+            case COLUMN_KIND_INT2:
+                type = ARROW_INT16;
+                break;
+            case COLUMN_KIND_INT4:
+                type = ARROW_INT32;
+                break;
+            case COLUMN_KIND_INT8:
+                type = ARROW_INT64;
+                break;
+            case COLUMN_KIND_OID:
+                type = ARROW_UINT32;
+                break;
+            case COLUMN_KIND_FLOAT4:
+                type = ARROW_FLOAT32;
+                break;
+            case COLUMN_KIND_FLOAT8:
+                type = ARROW_FLOAT64;
+                break;
+            case COLUMN_KIND_TIMESTAMP:
+                type = ARROW_TIMESTAMP;
+                break;
+            case COLUMN_KIND_TIMESTAMPTZ:
+                type = ARROW_TIMESTAMPTZ;
+                break;
+            case COLUMN_KIND_BYTEA:
+                type = ARROW_BINARY;
+                break;
+            default:
+                type = ARROW_UTF8;
+                break;
+        }
+
+        column_init(columns, plan->name, type);
+        columns->attnum = natt;
+        columns->kind = plan->kind;
+        columns->typoutput = plan->typoutput;
+        columns->typisvarlena = plan->typisvarlena;
+        columns++;
+    }
+}
+
+static int count_table_columns(JsonDecodingRelation *relinfo) {
+    int count = 0;
+    int natt;
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (!relinfo->columns[natt].skip) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static void flush_batch(LogicalDecodingContext *ctx, ArrowBatch *batch) {
+    JsonDecodingData *data = ctx->output_plugin_private;
+    int64 bytes = data->counters.bytes;
+    int i;
+
+    if (batch->nrows == 0) {
+        return;
+    }
+
+    pg_output_prepare(ctx, true);
+
+    write_message(ctx->out, batch, true);
+    write_message(ctx->out, batch, false);
+
+    /* end-of-stream */
+    append_u32(ctx->out, 0xffffffff);
+    append_u32(ctx->out, 0);
+
+    pg_output_write(ctx, true);
+
+    bytes = data->counters.bytes - bytes;
+    data->flushed_bytes += bytes;
+    if (data->relation_stats) {
+        batch->relinfo->stats_bytes += bytes;
+    }
+
+    for (i = 0; i < batch->ncolumns; i++) {
+        column_reset(&batch->columns[i]);
+    }
+    batch->nrows = 0;
+
+    data->arrow_buffered_bytes -= batch->bytes;
+    batch->bytes = 0;
+}
+
+static void column_init(ArrowColumn *column, const char *name, ArrowType type) {
+    column->name = pstrdup(name);
+    column->type = type;
+    column->attnum = -1;
+    initStringInfo(&column->validity);
+    initStringInfo(&column->values);
+    initStringInfo(&column->offsets);
+    column_reset(column);
+}
+
+static void column_reset(ArrowColumn *column) {
+    int i;
+
+    resetStringInfo(&column->validity);
+    resetStringInfo(&column->values);
+    resetStringInfo(&column->offsets);
+    column->null_count = 0;
+
+    if (column->type == ARROW_UTF8 || column->type == ARROW_BINARY) {
+        int32 offset = 0;
+
+        appendBinaryStringInfo(&column->offsets, (char *) &offset, sizeof(int32));
+    }
+
+    for (i = 0; i < column->nchildren; i++) {
+        column_reset(&column->children[i]);
+    }
+}
+
+static void column_append_null(ArrowColumn *column, int64 index) {
+    static const char zeros[8] = {0};
+    int i;
+
+    bitmap_append(&column->validity, index, false);
+    column->null_count++;
+
+    switch (column->type) {
+        case ARROW_BOOL:
+            bitmap_append(&column->values, index, false);
+            break;
+        case ARROW_INT16:
+            appendBinaryStringInfo(&column->values, zeros, sizeof(int16));
+            break;
+        case ARROW_INT32:
+        case ARROW_UINT32:
+        case ARROW_FLOAT32:
+            appendBinaryStringInfo(&column->values, zeros, sizeof(int32));
+            break;
+        case ARROW_INT64:
+        case ARROW_UINT64:
+        case ARROW_FLOAT64:
+        case ARROW_TIMESTAMP:
+        case ARROW_TIMESTAMPTZ:
+            appendBinaryStringInfo(&column->values, zeros, sizeof(int64));
+            break;
+        case ARROW_UTF8:
+        case ARROW_BINARY:
+            appendBinaryStringInfo(&column->offsets, (char *) &column->values.len, sizeof(int32));
+            break;
+        case ARROW_STRUCT:
+            for (i = 0; i < column->nchildren; i++) {
+                column_append_null(&column->children[i], index);
+            }
+            break;
+    }
+}
+
+static void column_append_fixed(ArrowColumn *column, int64 index, const void *value, int width) {
+    bitmap_append(&column->validity, index, true);
+    appendBinaryStringInfo(&column->values, value, width);
+}
+
+static void column_append_bytes(ArrowColumn *column, int64 index, const char *value, int len) {
+    bitmap_append(&column->validity, index, true);
+    appendBinaryStringInfo(&column->values, value, len);
+    appendBinaryStringInfo(&column->offsets, (char *) &column->values.len, sizeof(int32));
+}
+
+static void column_append_datum(ArrowColumn *column, int64 index, Datum value) {
+    struct varlena *detoasted;
+    char *output;
+    int16 int16_value;
+    int32 int32_value;
+    int64 int64_value;
+    float4 float4_value;
+    float8 float8_value;
+
+    switch (column->kind) {
+        case COLUMN_KIND_BOOL:
+            bitmap_append(&column->validity, index, true);
+            bitmap_append(&column->values, index, DatumGetBool(value));
+            break;
+        case COLUMN_KIND_INT2:
+            int16_value = DatumGetInt16(value);
+            column_append_fixed(column, index, &int16_value, sizeof(int16));
+            break;
+        case COLUMN_KIND_INT4:
+        case COLUMN_KIND_OID:
+            int32_value = DatumGetInt32(value);
+            column_append_fixed(column, index, &int32_value, sizeof(int32));
+            break;
+        case COLUMN_KIND_INT8:
+            int64_value = DatumGetInt64(value);
+            column_append_fixed(column, index, &int64_value, sizeof(int64));
+            break;
+        case COLUMN_KIND_FLOAT4:
+            float4_value = DatumGetFloat4(value);
+            column_append_fixed(column, index, &float4_value, sizeof(float4));
+            break;
+        case COLUMN_KIND_FLOAT8:
+            float8_value = DatumGetFloat8(value);
+            column_append_fixed(column, index, &float8_value, sizeof(float8));
+            break;
+        case COLUMN_KIND_TIMESTAMP:
+        case COLUMN_KIND_TIMESTAMPTZ:
+            int64_value = timestamp_to_unix_micros(DatumGetTimestampTz(value));
+            column_append_fixed(column, index, &int64_value, sizeof(int64));
+            break;
+        case COLUMN_KIND_TEXT:
+        case COLUMN_KIND_BYTEA:
+            detoasted = PG_DETOAST_DATUM_PACKED(value);
+            column_append_bytes(column, index, VARDATA_ANY(detoasted), VARSIZE_ANY_EXHDR(detoasted));
+            break;
+        default:
+            if (column->typisvarlena) {
+                value = PointerGetDatum(PG_DETOAST_DATUM(value));
+            }
+            output = OidOutputFunctionCall(column->typoutput, value);
+            column_append_bytes(column, index, output, strlen(output));
+            break;
+    }
+}
+
+/*
+ * Unchanged TOAST values are not available to the decoder and are null.
+ */
+static void append_tuple(ArrowColumn *columns,
+                         int ncolumns,
+                         JsonDecodingData *data,
+                         JsonDecodingRelation *relinfo,
+                         TupleDesc tupdesc,
+                         HeapTuple tuple,
+                         int64 index) {
+    int i;
+
+    if (tuple != NULL) {
+        heap_deform_tuple(tuple, tupdesc, relinfo->values, relinfo->nulls);
+    }
+
+    for (i = 0; i < ncolumns; i++) {
+        ArrowColumn *column = &columns[i];
+        Datum value;
+
+        if (tuple == NULL || relinfo->nulls[column->attnum]) {
+            column_append_null(column, index);
+            continue;
+        }
+
+        value = relinfo->values[column->attnum];
+
+        if (column->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(value) && !data->include_toast_datum) {
+            column_append_null(column, index);
+            continue;
+        }
+
+        column_append_datum(column, index, value);
+    }
+}
+
+/*
+ * Validity and boolean bitmaps, least significant bit first.
+ */
+static void bitmap_append(StringInfo bitmap, int64 index, bool bit) {
+    if (index % 8 == 0) {
+        appendStringInfoChar(bitmap, '\0');
+    }
+    if (bit) {
+        bitmap->data[index / 8] |= (char) (1 << (index % 8));
+    }
+}
+
+/*
+ * Encapsulated IPC message: continuation marker, metadata size, the
+ * flatbuffer Message padded to 8 bytes, then the body.
+ *
+ * The flatbuffer is written front to back: parents first, with offsets
+ * patched once their targets have been written, which keeps every uoffset
+ * pointing forward as the format requires.
+ */
+static void write_message(StringInfo s, ArrowBatch *batch, bool schema) {
+    static const int sizes[4] = {2, 1, 4, 8};
+    int positions[4];
+    int start = s->len;
+    int base;
+    int root;
+    int message;
+    int header;
+    int64 body_length = 0;
+
+    append_u32(s, 0xffffffff);
+    append_u32(s, 0);
+
+    base = s->len;
+    root = s->len;
+    append_u32(s, 0);
+
+    /* version, header_type, header, bodyLength */
+    message = fb_table(s, base, 4, sizes, positions);
+    fb_link(s, root, message);
+    put_le(s, positions[0], ARROW_METADATA_V5, 2);
+    put_le(s, positions[1], schema ? ARROW_HEADER_SCHEMA : ARROW_HEADER_RECORD_BATCH, 1);
+
+    if (schema) {
+        header = write_schema(s, base, batch);
+    } else {
+        header = write_record_batch(s, base, batch, &body_length);
+    }
+    fb_link(s, positions[2], header);
+    put_le(s, positions[3], body_length, 8);
+
+    fb_pad(s, base, 8);
+    put_le(s, start + 4, s->len - base, 4);
+
+    if (!schema) {
+        append_body(s, batch->columns, batch->ncolumns);
+    }
+}
+
+static int write_schema(StringInfo s, int base, ArrowBatch *batch) {
+    static const int sizes[3] = {2, 4, 4};
+    static const int key_value_sizes[2] = {4, 4};
+    int positions[3];
+    int key_value_positions[2];
+    int table;
+    int metadata;
+    int element;
+    int key_value;
+
+    /* endianness, fields, custom_metadata */
+    table = fb_table(s, base, 3, sizes, positions);
+    put_le(s, positions[0], ARROW_ENDIANNESS, 2);
+
+    fb_link(s, positions[1], write_field_vector(s, base, batch->columns, batch->ncolumns));
+
+    metadata = fb_vector(s, base, 1, 4);
+    element = s->len;
+    append_u32(s, 0);
+    fb_link(s, positions[2], metadata);
+
+    key_value = fb_table(s, base, 2, key_value_sizes, key_value_positions);
+    fb_link(s, element, key_value);
+    fb_link(s, key_value_positions[0], fb_string(s, base, "table"));
+    fb_link(s, key_value_positions[1], fb_string(s, base, batch->table_name));
+
+    return table;
+}
+
+static int write_field_vector(StringInfo s, int base, ArrowColumn *columns, int ncolumns) {
+    int vector;
+    int elements;
+    int i;
+
+    vector = fb_vector(s, base, ncolumns, 4);
+    elements = s->len;
+    for (i = 0; i < ncolumns; i++) {
+        append_u32(s, 0);
+    }
+
+    for (i = 0; i < ncolumns; i++) {
+        fb_link(s, elements + i * 4, write_field(s, base, &columns[i]));
+    }
+
+    return vector;
+}
+
+static int write_field(StringInfo s, int base, ArrowColumn *column) {
+    /* name, nullable, type_type, type, dictionary, children, custom_metadata */
+    static const int sizes[7] = {4, 1, 1, 4, 0, 4, 0};
+    int positions[7];
+    int table;
+    uint8 type_id;
+
+    switch (column->type) {
+        case ARROW_BOOL:
+            type_id = ARROW_TYPE_ID_BOOL;
+            break;
+        case ARROW_FLOAT32:
+        case ARROW_FLOAT64:
+            type_id = ARROW_TYPE_ID_FLOATING_POINT;
+            break;
+        case ARROW_TIMESTAMP:
+        case ARROW_TIMESTAMPTZ:
+            type_id = ARROW_TYPE_ID_TIMESTAMP;
+            break;
+        case ARROW_UTF8:
+            type_id = ARROW_TYPE_ID_UTF8;
+            break;
+        case ARROW_BINARY:
+            type_id = ARROW_TYPE_ID_BINARY;
+            break;
+        case ARROW_STRUCT:
+            type_id = ARROW_TYPE_ID_STRUCT;
+            break;
+        default:
+            type_id = ARROW_TYPE_ID_INT;
+            break;
+    }
+
+    table = fb_table(s, base, 7, sizes, positions);
+    put_le(s, positions[1], 1, 1);
+    put_le(s, positions[2], type_id, 1);
+
+    fb_link(s, positions[0], fb_string(s, base, column->name));
+    fb_link(s, positions[3], write_type(s, base, column->type));
+    fb_link(s, positions[5], write_field_vector(s, base, column->children, column->nchildren));
+
+    return table;
+}
+
+static int write_type(StringInfo s, int base, ArrowType type) {
+    static const int int_sizes[2] = {4, 1};
+    static const int float_sizes[1] = {2};
+    static const int timestamp_sizes[2] = {2, 0};
+    static const int timestamptz_sizes[2] = {2, 4};
+    int positions[2];
+    int table;
+
+    switch (type) {
+        case ARROW_INT16:
+        case ARROW_INT32:
+        case ARROW_INT64:
+        case ARROW_UINT32:
+        case ARROW_UINT64:
+            /* bitWidth, is_signed */
+            table = fb_table(s, base, 2, int_sizes, positions);
+            put_le(s, positions[0], type == ARROW_INT16 ? 16 : type == ARROW_INT64 || type == ARROW_UINT64 ? 64 : 32, 4);
+            put_le(s, positions[1], type == ARROW_UINT32 || type == ARROW_UINT64 ? 0 : 1, 1);
+            return table;
+        case ARROW_FLOAT32:
+        case ARROW_FLOAT64:
+            /* precision */
+            table = fb_table(s, base, 1, float_sizes, positions);
+            put_le(s, positions[0], type == ARROW_FLOAT32 ? ARROW_PRECISION_SINGLE : ARROW_PRECISION_DOUBLE, 2);
+            return table;
+        case ARROW_TIMESTAMP:
+            /* unit, timezone */
+            table = fb_table(s, base, 2, timestamp_sizes, positions);
+            put_le(s, positions[0], ARROW_TIME_UNIT_MICROSECOND, 2);
+            return table;
+        case ARROW_TIMESTAMPTZ:
+            table = fb_table(s, base, 2, timestamptz_sizes, positions);
+            put_le(s, positions[0], ARROW_TIME_UNIT_MICROSECOND, 2);
+            fb_link(s, positions[1], fb_string(s, base, "UTC"));
+            return table;
+        default:
+            /* Bool, Utf8, Binary and Struct_ have no fields */
+            return fb_table(s, base, 0, NULL, NULL);
+    }
+}
+
+static int write_record_batch(StringInfo s, int base, ArrowBatch *batch, int64 *body_length) {
+    static const int sizes[3] = {8, 4, 4};
+    int positions[3];
+    int table;
+    int vector;
+
+    /* length, nodes, buffers */
+    table = fb_table(s, base, 3, sizes, positions);
+    put_le(s, positions[0], batch->nrows, 8);
+
+    vector = fb_vector(s, base, count_nodes(batch->columns, batch->ncolumns), 16);
+    append_nodes(s, batch->columns, batch->ncolumns, batch->nrows);
+    fb_link(s, positions[1], vector);
+
+    vector = fb_vector(s, base, count_buffers(batch->columns, batch->ncolumns), 16);
+    append_buffer_specs(s, batch->columns, batch->ncolumns, body_length);
+    fb_link(s, positions[2], vector);
+
+    return table;
+}
+
+static int count_nodes(ArrowColumn *columns, int ncolumns) {
+    int count = 0;
+    int i;
+
+    for (i = 0; i < ncolumns; i++) {
+        count += 1 + count_nodes(columns[i].children, columns[i].nchildren);
+    }
+
+    return count;
+}
+
+/*
+ * The buffers of a column in IPC order; a validity bitmap without nulls is
+ * written with length 0.
+ */
+static int column_buffers(ArrowColumn *column, StringInfo *buffers) {
+    buffers[0] = column->null_count > 0 ? &column->validity : NULL;
+
+    switch (column->type) {
+        case ARROW_STRUCT:
+            return 1;
+        case ARROW_UTF8:
+        case ARROW_BINARY:
+            buffers[1] = &column->offsets;
+            buffers[2] = &column->values;
+            return 3;
+        default:
+            buffers[1] = &column->values;
+            return 2;
+    }
+}
+
+static int count_buffers(ArrowColumn *columns, int ncolumns) {
+    StringInfo buffers[3];
+    int count = 0;
+    int i;
+
+    for (i = 0; i < ncolumns; i++) {
+        count += column_buffers(&columns[i], buffers) + count_buffers(columns[i].children, columns[i].nchildren);
+    }
+
+    return count;
+}
+
+static int64 columns_bytes(ArrowColumn *columns, int ncolumns) {
+    int64 bytes = 0;
+    int i;
+
+    for (i = 0; i < ncolumns; i++) {
+        bytes += columns[i].validity.len + columns[i].values.len + columns[i].offsets.len +
+                 columns_bytes(columns[i].children, columns[i].nchildren);
+    }
+
+    return bytes;
+}
+
+static void append_nodes(StringInfo s, ArrowColumn *columns, int ncolumns, int64 nrows) {
+    int i;
+
+    for (i = 0; i < ncolumns; i++) {
+        /* FieldNode { length, null_count } */
+        append_u64(s, nrows);
+        append_u64(s, columns[i].null_count);
+        append_nodes(s, columns[i].children, columns[i].nchildren, nrows);
+    }
+}
+
+static void append_buffer_specs(StringInfo s, ArrowColumn *columns, int ncolumns, int64 *offset) {
+    StringInfo buffers[3];
+    int nbuffers;
+    int i;
+    int j;
+
+    for (i = 0; i < ncolumns; i++) {
+        nbuffers = column_buffers(&columns[i], buffers);
+
+        for (j = 0; j < nbuffers; j++) {
+            int64 length = buffers[j] != NULL ? buffers[j]->len : 0;
+
+            /* Buffer { offset, length } */
+            append_u64(s, *offset);
+            append_u64(s, length);
+            *offset += TYPEALIGN(8, length);
+        }
+
+        append_buffer_specs(s, columns[i].children, columns[i].nchildren, offset);
+    }
+}
+
+static void append_body(StringInfo s, ArrowColumn *columns, int ncolumns) {
+    StringInfo buffers[3];
+    int nbuffers;
+    int i;
+    int j;
+
+    for (i = 0; i < ncolumns; i++) {
+        nbuffers = column_buffers(&columns[i], buffers);
+
+        for (j = 0; j < nbuffers; j++) {
+            if (buffers[j] != NULL) {
+                int start = s->len;
+
+                appendBinaryStringInfo(s, buffers[j]->data, buffers[j]->len);
+                fb_pad(s, start, 8);
+            }
+        }
+
+        append_body(s, columns[i].children, columns[i].nchildren);
+    }
+}
+
+/*
+ * Write a vtable followed by a zeroed table with the given inline field
+ * sizes (0 for absent fields) and return the table position. The table is
+ * 8-byte aligned and every field is aligned to its size.
+ */
+static int fb_table(StringInfo s, int base, int nfields, const int *sizes, int *positions) {
+    int offsets[ARROW_MAX_TABLE_FIELDS];
+    int vtable_size = 4 + 2 * nfields;
+    int table_size = 4;
+    int vtable;
+    int table;
+    int i;
+
+    Assert(nfields <= ARROW_MAX_TABLE_FIELDS);
+
+    for (i = 0; i < nfields; i++) {
+        if (sizes[i] == 0) {
+            offsets[i] = 0;
+            continue;
+        }
+        table_size = TYPEALIGN(sizes[i], table_size);
+        offsets[i] = table_size;
+        table_size += sizes[i];
+    }
+
+    while ((s->len + vtable_size - base) % 8 != 0) {
+        appendStringInfoChar(s, '\0');
+    }
+
+    vtable = s->len;
+    append_u16(s, vtable_size);
+    append_u16(s, table_size);
+    for (i = 0; i < nfields; i++) {
+        append_u16(s, offsets[i]);
+    }
+
+    table = s->len;
+    append_u32(s, table - vtable);
+    while (s->len < table + table_size) {
+        appendStringInfoChar(s, '\0');
+    }
+
+    for (i = 0; i < nfields; i++) {
+        positions[i] = sizes[i] != 0 ? table + offsets[i] : -1;
+    }
+
+    return table;
+}
+
+/*
+ * Write a vector length; the caller appends the elements, which are
+ * aligned to their size.
+ */
+static int fb_vector(StringInfo s, int base, int count, int element_size) {
+    int alignment = Max(element_size, 4);
+    int vector;
+
+    while ((s->len + 4 - base) % alignment != 0) {
+        appendStringInfoChar(s, '\0');
+    }
+
+    vector = s->len;
+    append_u32(s, count);
+
+    return vector;
+}
+
+static int fb_string(StringInfo s, int base, const char *value) {
+    int len = strlen(value);
+    int string;
+
+    fb_pad(s, base, 4);
+
+    string = s->len;
+    append_u32(s, len);
+    appendBinaryStringInfo(s, value, len);
+    appendStringInfoChar(s, '\0');
+
+    return string;
+}
+
+static void fb_link(StringInfo s, int position, int target) {
+    Assert(target > position);
+
+    put_le(s, position, target - position, 4);
+}
+
+static void fb_pad(StringInfo s, int base, int alignment) {
+    while ((s->len - base) % alignment != 0) {
+        appendStringInfoChar(s, '\0');
+    }
+}
+
+static void append_u16(StringInfo s, uint16 value) {
+    enlargeStringInfo(s, 2);
+    s->len += 2;
+    put_le(s, s->len - 2, value, 2);
+    s->data[s->len] = '\0';
+}
+
+static void append_u32(StringInfo s, uint32 value) {
+    enlargeStringInfo(s, 4);
+    s->len += 4;
+    put_le(s, s->len - 4, value, 4);
+    s->data[s->len] = '\0';
+}
+
+static void append_u64(StringInfo s, uint64 value) {
+    enlargeStringInfo(s, 8);
+    s->len += 8;
+    put_le(s, s->len - 8, value, 8);
+    s->data[s->len] = '\0';
+}
+
+static void put_le(StringInfo s, int position, uint64 value, int width) {
+    int i;
+
+    for (i = 0; i < width; i++) {
+        s->data[position + i] = (char) (value >> (i * 8));
+    }
+}
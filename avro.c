@@ -0,0 +1,533 @@
+/*
+ * Avro output (format=avro).
+ *
+ * Each relation gets a record schema derived from its TupleDesc: the change
+ * type, the optional commit timestamp and xid, a nullable record with the
+ * old key and one nullable field per column. Rows are written with the Avro
+ * single-object encoding (0xC3 0x01, the CRC-64-AVRO fingerprint of the
+ * schema's Parsing Canonical Form, then the binary record), so consumers
+ * can pick the schema by fingerprint. A schema message, the JSON object
+ * {"fingerprint":"<hex>","schema":<schema>}, is written before the first
+ * row of a relation and again whenever its schema changes.
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+
+#include "libpq/pqformat.h"
+
+#include "json_decoding_internal.h"
+
+#define AVRO_FINGERPRINT_EMPTY UINT64CONST(0xc15d213aa4d7a795)
+
+static uint64 avro_fingerprint_table[256];
+static bool avro_fingerprint_table_ready = false;
+
+/* field names of a record schema, as valid and distinct Avro names */
+typedef struct {
+    List *used;
+    char *type;
+    char *timestamp;
+    char *xid;
+    char *lsn;
+    char *commit_lsn;
+    char *seq;
+    char *decode_lag;
+    char *old_key;
+    char **columns;
+} AvroFieldNames;
+
+/*
+ * Helper Methods.
+ */
+static void build_field_names(AvroFieldNames *names, JsonDecodingData *data, JsonDecodingRelation *relinfo);
+
+static char *field_name(AvroFieldNames *names, const char *name);
+
+static void append_schema(StringInfo s,
+                          JsonDecodingData *data,
+                          JsonDecodingRelation *relinfo,
+                          AvroFieldNames *names,
+                          const char *nspname,
+                          const char *relname,
+                          bool canonical);
+
+static void append_column_fields(StringInfo s,
+                                 JsonDecodingRelation *relinfo,
+                                 AvroFieldNames *names,
+                                 bool canonical,
+                                 bool first);
+
+static void append_field_start(StringInfo s, const char *name, bool first);
+
+static void append_field_end(StringInfo s, bool nullable, bool canonical);
+
+static void append_name(StringInfo s, const char *name);
+
+static const char *column_type(JsonDecodingColumnKind kind, bool canonical);
+
+static uint64 schema_fingerprint(const char *canonical_form);
+
+static void tuple_to_avro(StringInfo s,
+                          JsonDecodingData *data,
+                          JsonDecodingRelation *relinfo,
+                          TupleDesc tupdesc,
+                          HeapTuple tuple);
+
+static void datum_to_avro(StringInfo s, JsonDecodingColumn *column, Datum value);
+
+static void avro_write_long(StringInfo s, int64 value);
+
+static void avro_write_bytes(StringInfo s, const char *value, int len);
+/*
+ * Implementation.
+ */
+
+/*
+ * Build the schema and its fingerprint for a relation plan. Called from
+ * build_relation_plan with the relation's plan context current.
+ */
+void avro_build_schema(JsonDecodingData *data,
+                       JsonDecodingRelation *relinfo,
+                       const char *nspname,
+                       const char *relname) {
+    StringInfoData schema;
+    AvroFieldNames names;
+
+    build_field_names(&names, data, relinfo);
+
+    initStringInfo(&schema);
+    append_schema(&schema, data, relinfo, &names, nspname, relname, true);
+    relinfo->avro_fingerprint = schema_fingerprint(schema.data);
+
+    resetStringInfo(&schema);
+    append_schema(&schema, data, relinfo, &names, nspname, relname, false);
+    relinfo->avro_schema = schema.data;
+}
+
+bool avro_schema_pending(JsonDecodingRelation *relinfo) {
+    return !relinfo->avro_schema_sent || relinfo->avro_sent_fingerprint != relinfo->avro_fingerprint;
+}
+
+void avro_schema_message(StringInfo s, JsonDecodingRelation *relinfo) {
+    appendStringInfo(s, "{\"fingerprint\":\"%016" INT64_MODIFIER "x\",\"schema\":%s}",
+                     relinfo->avro_fingerprint, relinfo->avro_schema);
+
+    relinfo->avro_schema_sent = true;
+    relinfo->avro_sent_fingerprint = relinfo->avro_fingerprint;
+}
+
+void change_to_avro(StringInfo s,
+                    JsonDecodingData *data,
+                    JsonDecodingRelation *relinfo,
+                    TupleDesc tupdesc,
+                    ReorderBufferTXN *txn,
+                    ReorderBufferChange *change) {
+    HeapTuple oldtuple = change->data.tp.oldtuple != NULL ? &change->data.tp.oldtuple->tuple : NULL;
+    HeapTuple newtuple = change->data.tp.newtuple != NULL ? &change->data.tp.newtuple->tuple : NULL;
+    const char *type = change_type_name(change->action);
+    uint64 fingerprint = relinfo->avro_fingerprint;
+    int i;
+
+    /* single-object encoding header, fingerprint in little-endian order */
+    pq_sendbyte(s, 0xc3);
+    pq_sendbyte(s, 0x01);
+    for (i = 0; i < 8; i++) {
+        pq_sendbyte(s, (uint8) (fingerprint >> (i * 8)));
+    }
+
+    avro_write_bytes(s, type, strlen(type));
+
+    if (data->include_timestamp) {
+        avro_write_long(s, timestamp_to_unix_micros(TXN_COMMIT_TIME(txn)));
+    }
+
+    if (data->include_xids) {
+        avro_write_long(s, txn->xid);
+    }
+
+    if (data->include_lsn) {
+        avro_write_long(s, change->lsn);
+        avro_write_long(s, txn->final_lsn);
+        avro_write_long(s, data->xact_changes);
+    }
+
+    if (data->include_decode_lag) {
+        avro_write_long(s, decode_lag_ms(txn));
+    }
+
+    if (change->action == REORDER_BUFFER_CHANGE_UPDATE && oldtuple != NULL) {
+        avro_write_long(s, 1);
+        tuple_to_avro(s, data, relinfo, tupdesc, oldtuple);
+    } else {
+        avro_write_long(s, 0);
+    }
+
+    tuple_to_avro(s, data, relinfo, tupdesc,
+                  change->action == REORDER_BUFFER_CHANGE_DELETE ? oldtuple : newtuple);
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * Names of the record's fields, in schema order. A name that is taken once
+ * made a valid Avro name, say "a-b" after "a_b" or a column named like a
+ * metadata key, gets the first free suffix "_2", "_3", ...
+ */
+static void build_field_names(AvroFieldNames *names, JsonDecodingData *data, JsonDecodingRelation *relinfo) {
+    int natt;
+
+    names->used = NIL;
+    names->type = field_name(names, data->key_type);
+    names->timestamp = data->include_timestamp ? field_name(names, data->key_timestamp) : NULL;
+    names->xid = data->include_xids ? field_name(names, data->key_xid) : NULL;
+    names->lsn = data->include_lsn ? field_name(names, KEY_LSN) : NULL;
+    names->commit_lsn = data->include_lsn ? field_name(names, KEY_COMMIT_LSN) : NULL;
+    names->seq = data->include_lsn ? field_name(names, KEY_SEQ) : NULL;
+    names->decode_lag = data->include_decode_lag ? field_name(names, KEY_DECODE_LAG) : NULL;
+    names->old_key = field_name(names, data->key_old_primary_key);
+
+    names->columns = palloc0(sizeof(char *) * Max(relinfo->natts, 1));
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (!relinfo->columns[natt].skip) {
+            names->columns[natt] = field_name(names, relinfo->columns[natt].name);
+        }
+    }
+}
+
+static char *field_name(AvroFieldNames *names, const char *name) {
+    StringInfoData buf;
+    int base_len;
+    int suffix = 1;
+    ListCell *lc;
+
+    initStringInfo(&buf);
+    append_name(&buf, name);
+    base_len = buf.len;
+
+    for (;;) {
+        bool taken = false;
+
+        foreach(lc, names->used) {
+            if (strcmp((char *) lfirst(lc), buf.data) == 0) {
+                taken = true;
+                break;
+            }
+        }
+
+        if (!taken) {
+            break;
+        }
+
+        buf.len = base_len;
+        buf.data[buf.len] = '\0';
+        appendStringInfo(&buf, "_%d", ++suffix);
+    }
+
+    names->used = lappend(names->used, buf.data);
+
+    return buf.data;
+}
+
+/*
+ * The canonical form only keeps name, type and fields (in that order) and
+ * drops defaults and logical types; the full schema adds them back.
+ */
+static void append_schema(StringInfo s,
+                          JsonDecodingData *data,
+                          JsonDecodingRelation *relinfo,
+                          AvroFieldNames *names,
+                          const char *nspname,
+                          const char *relname,
+                          bool canonical) {
+    appendStringInfoString(s, "{\"name\":\"");
+    append_name(s, nspname);
+    appendStringInfoChar(s, '.');
+    append_name(s, relname);
+    appendStringInfoString(s, "\",\"type\":\"record\",\"fields\":[");
+
+    append_field_start(s, names->type, true);
+    appendStringInfoString(s, "\"string\"");
+    append_field_end(s, false, canonical);
+
+    if (data->include_timestamp) {
+        append_field_start(s, names->timestamp, false);
+        appendStringInfoString(s, column_type(COLUMN_KIND_TIMESTAMPTZ, canonical));
+        append_field_end(s, false, canonical);
+    }
+
+    if (data->include_xids) {
+        append_field_start(s, names->xid, false);
+        appendStringInfoString(s, "\"long\"");
+        append_field_end(s, false, canonical);
+    }
+
+    if (data->include_lsn) {
+        append_field_start(s, names->lsn, false);
+        appendStringInfoString(s, "\"long\"");
+        append_field_end(s, false, canonical);
+        append_field_start(s, names->commit_lsn, false);
+        appendStringInfoString(s, "\"long\"");
+        append_field_end(s, false, canonical);
+        append_field_start(s, names->seq, false);
+        appendStringInfoString(s, "\"long\"");
+        append_field_end(s, false, canonical);
+    }
+
+    if (data->include_decode_lag) {
+        append_field_start(s, names->decode_lag, false);
+        appendStringInfoString(s, "\"long\"");
+        append_field_end(s, false, canonical);
+    }
+
+    append_field_start(s, names->old_key, false);
+    appendStringInfoString(s, "[\"null\",{\"name\":\"");
+    append_name(s, nspname);
+    appendStringInfoChar(s, '.');
+    append_name(s, relname);
+    appendStringInfoString(s, "_key\",\"type\":\"record\",\"fields\":[");
+    append_column_fields(s, relinfo, names, canonical, true);
+    appendStringInfoString(s, "]}]");
+    append_field_end(s, true, canonical);
+
+    append_column_fields(s, relinfo, names, canonical, false);
+
+    appendStringInfoString(s, "]}");
+}
+
+static void append_column_fields(StringInfo s,
+                                 JsonDecodingRelation *relinfo,
+                                 AvroFieldNames *names,
+                                 bool canonical,
+                                 bool first) {
+    int natt;
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+
+        if (column->skip) {
+            continue;
+        }
+
+        append_field_start(s, names->columns[natt], first);
+        appendStringInfoString(s, "[\"null\",");
+        appendStringInfoString(s, column_type(column->kind, canonical));
+        appendStringInfoChar(s, ']');
+        append_field_end(s, true, canonical);
+        first = false;
+    }
+}
+
+static void append_field_start(StringInfo s, const char *name, bool first) {
+    if (!first) {
+        appendStringInfoChar(s, ',');
+    }
+    appendStringInfoString(s, "{\"name\":\"");
+    appendStringInfoString(s, name);
+    appendStringInfoString(s, "\",\"type\":");
+}
+
+static void append_field_end(StringInfo s, bool nullable, bool canonical) {
+    if (nullable && !canonical) {
+        appendStringInfoString(s, ",\"default\":null");
+    }
+    appendStringInfoChar(s, '}');
+}
+
+/*
+ * Avro names are [A-Za-z_][A-Za-z0-9_]*; anything else becomes '_'.
+ */
+static void append_name(StringInfo s, const char *name) {
+    const char *p;
+
+    if (*name == '\0' || (*name >= '0' && *name <= '9')) {
+        appendStringInfoChar(s, '_');
+    }
+
+    for (p = name; *p; p++) {
+        char ch = *p;
+
+        if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '_') {
+            appendStringInfoChar(s, ch);
+        } else {
+            appendStringInfoChar(s, '_');
+        }
+    }
+}
+
+static const char *column_type(JsonDecodingColumnKind kind, bool canonical) {
+    switch (kind) {
+        case COLUMN_KIND_BOOL:
+            return "\"boolean\"";
+        case COLUMN_KIND_INT2:
+        case COLUMN_KIND_INT4:
+            return "\"int\"";
+        case COLUMN_KIND_INT8:
+        case COLUMN_KIND_OID:
+            return "\"long\"";
+        case COLUMN_KIND_FLOAT4:
+            return "\"float\"";
+        case COLUMN_KIND_FLOAT8:
+            return "\"double\"";
+        case COLUMN_KIND_TIMESTAMP:
+            return canonical ? "\"long\"" : "{\"type\":\"long\",\"logicalType\":\"local-timestamp-micros\"}";
+        case COLUMN_KIND_TIMESTAMPTZ:
+            return canonical ? "\"long\"" : "{\"type\":\"long\",\"logicalType\":\"timestamp-micros\"}";
+        case COLUMN_KIND_BYTEA:
+            return "\"bytes\"";
+        default:
+            return "\"string\"";
+    }
+}
+
+/*
+ * CRC-64-AVRO (Rabin) fingerprint, as defined by the Avro specification.
+ */
+static uint64 schema_fingerprint(const char *canonical_form) {
+    uint64 fingerprint = AVRO_FINGERPRINT_EMPTY;
+    const unsigned char *p;
+
+    if (!avro_fingerprint_table_ready) {
+        int i;
+        int j;
+
+        for (i = 0; i < 256; i++) {
+            uint64 entry = i;
+
+            for (j = 0; j < 8; j++) {
+                entry = (entry >> 1) ^ (AVRO_FINGERPRINT_EMPTY & -(entry & 1));
+            }
+            avro_fingerprint_table[i] = entry;
+        }
+        avro_fingerprint_table_ready = true;
+    }
+
+    for (p = (const unsigned char *) canonical_form; *p; p++) {
+        fingerprint = (fingerprint >> 8) ^ avro_fingerprint_table[(fingerprint ^ *p) & 0xff];
+    }
+
+    return fingerprint;
+}
+
+/*
+ * Every column is a ["null", T] union. Unchanged TOAST values are not
+ * available to the decoder and are written as null.
+ */
+static void tuple_to_avro(StringInfo s,
+                          JsonDecodingData *data,
+                          JsonDecodingRelation *relinfo,
+                          TupleDesc tupdesc,
+                          HeapTuple tuple) {
+    int natt;
+
+    if (tuple != NULL) {
+        heap_deform_tuple(tuple, tupdesc, relinfo->values, relinfo->nulls);
+    }
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+        Datum value;
+
+        if (column->skip) {
+            continue;
+        }
+
+        if (tuple == NULL || relinfo->nulls[natt]) {
+            avro_write_long(s, 0);
+            continue;
+        }
+
+        value = relinfo->values[natt];
+
+        if (column->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(value) && !data->include_toast_datum) {
+            avro_write_long(s, 0);
+            continue;
+        }
+
+        avro_write_long(s, 1);
+        datum_to_avro(s, column, value);
+    }
+}
+
+static void datum_to_avro(StringInfo s, JsonDecodingColumn *column, Datum value) {
+    struct varlena *detoasted;
+    char *output;
+    union {
+        float4 f;
+        uint32 i;
+    } float4_bits;
+    union {
+        float8 f;
+        uint64 i;
+    } float8_bits;
+    int i;
+
+    switch (column->kind) {
+        case COLUMN_KIND_BOOL:
+            pq_sendbyte(s, DatumGetBool(value) ? 1 : 0);
+            break;
+        case COLUMN_KIND_INT2:
+            avro_write_long(s, DatumGetInt16(value));
+            break;
+        case COLUMN_KIND_INT4:
+            avro_write_long(s, DatumGetInt32(value));
+            break;
+        case COLUMN_KIND_INT8:
+            avro_write_long(s, DatumGetInt64(value));
+            break;
+        case COLUMN_KIND_OID:
+            avro_write_long(s, DatumGetObjectId(value));
+            break;
+        case COLUMN_KIND_FLOAT4:
+            float4_bits.f = DatumGetFloat4(value);
+            for (i = 0; i < 4; i++) {
+                pq_sendbyte(s, (uint8) (float4_bits.i >> (i * 8)));
+            }
+            break;
+        case COLUMN_KIND_FLOAT8:
+            float8_bits.f = DatumGetFloat8(value);
+            for (i = 0; i < 8; i++) {
+                pq_sendbyte(s, (uint8) (float8_bits.i >> (i * 8)));
+            }
+            break;
+        case COLUMN_KIND_TIMESTAMP:
+        case COLUMN_KIND_TIMESTAMPTZ:
+            avro_write_long(s, timestamp_to_unix_micros(DatumGetTimestampTz(value)));
+            break;
+        case COLUMN_KIND_TEXT:
+        case COLUMN_KIND_BYTEA:
+            detoasted = PG_DETOAST_DATUM_PACKED(value);
+            avro_write_bytes(s, VARDATA_ANY(detoasted), VARSIZE_ANY_EXHDR(detoasted));
+            break;
+        default:
+            if (column->typisvarlena) {
+                value = PointerGetDatum(PG_DETOAST_DATUM(value));
+            }
+            output = OidOutputFunctionCall(column->typoutput, value);
+            avro_write_bytes(s, output, strlen(output));
+            break;
+    }
+}
+
+/*
+ * Zig-zag encoded variable-length long.
+ */
+static void avro_write_long(StringInfo s, int64 value) {
+    uint64 encoded = ((uint64) value << 1) ^ (uint64) (value >> 63);
+
+    while (encoded > 0x7f) {
+        pq_sendbyte(s, (uint8) ((encoded & 0x7f) | 0x80));
+        encoded >>= 7;
+    }
+    pq_sendbyte(s, (uint8) encoded);
+}
+
+/*
+ * Strings and bytes share the same layout: a long length and the raw bytes.
+ */
+static void avro_write_bytes(StringInfo s, const char *value, int len) {
+    avro_write_long(s, len);
+    pq_sendbytes(s, value, len);
+}
@@ -0,0 +1,233 @@
+#!/usr/bin/perl
+#
+# Throughput of json_decoding against test_decoding.
+#
+# Starts a temporary cluster with wal_level=logical, runs each workload with
+# a slot of both plugins open, then drains the slots with
+# pg_logical_slot_get_changes and reports rows per second, bytes per row and
+# the CPU time of the draining backend per row.
+#
+#   perl bench/bench.pl [--bindir DIR] [--scale N] [--options name=value,...] [--workload NAME]
+#
+# --options are passed to json_decoding; a format other than json, or
+# compression, drains with pg_logical_slot_get_binary_changes. The CPU time
+# is read from /proc and only reported on Linux.
+
+use strict;
+use warnings;
+
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use POSIX qw(sysconf _SC_CLK_TCK);
+
+my $bindir = '';
+my $scale = 1;
+my $options = '';
+my $only = '';
+
+GetOptions('bindir=s' => \$bindir,
+           'scale=f' => \$scale,
+           'options=s' => \$options,
+           'workload=s' => \$only) or die "usage: $0 [--bindir DIR] [--scale N] [--options name=value,...] [--workload NAME]\n";
+
+sub rows { return int($_[0] * $scale) || 1 }
+
+# name, setup, workload and the number of rows it changes; the setup's
+# changes are drained before the workload runs
+my @workloads = (
+    {
+        name => 'narrow-inserts',
+        setup => 'CREATE TABLE bench (id int PRIMARY KEY, value int)',
+        run => sprintf('DO $$ BEGIN FOR i IN 1..%d LOOP INSERT INTO bench VALUES (i, i); COMMIT; END LOOP; END $$',
+                       rows(20000)),
+        rows => rows(20000),
+    },
+    {
+        name => 'wide-updates',
+        setup => 'CREATE TABLE bench (id int PRIMARY KEY, '
+            . join(', ', map { "c$_ int" } 1 .. 99) . '); '
+            . sprintf('INSERT INTO bench SELECT i, %s FROM generate_series(1, %d) i',
+                      join(', ', ('i') x 99), rows(20000)),
+        run => 'UPDATE bench SET c1 = c1 + 1',
+        rows => rows(20000),
+    },
+    {
+        name => 'text-heavy',
+        setup => 'CREATE TABLE bench (id int PRIMARY KEY, '
+            . join(', ', map { "t$_ text" } 1 .. 5) . ')',
+        run => sprintf('INSERT INTO bench SELECT i, %s FROM generate_series(1, %d) i',
+                       join(', ', map { "repeat(md5((i * $_)::text), 6)" } 1 .. 5), rows(50000)),
+        rows => rows(50000),
+    },
+    {
+        name => 'jsonb',
+        setup => 'CREATE TABLE bench (id int PRIMARY KEY, doc jsonb)',
+        run => sprintf('INSERT INTO bench SELECT i, (SELECT jsonb_object_agg(\'key\' || k, '
+                       . 'jsonb_build_object(\'n\', i * k, \'s\', md5(k::text))) FROM generate_series(1, 20) k) '
+                       . 'FROM generate_series(1, %d) i', rows(20000)),
+        rows => rows(20000),
+    },
+    {
+        name => 'bulk-load',
+        setup => 'CREATE TABLE bench (id int PRIMARY KEY, name text, amount numeric, created timestamptz)',
+        run => sprintf('INSERT INTO bench SELECT i, md5(i::text), i / 100.0, now() FROM generate_series(1, %d) i',
+                       rows(200000)),
+        rows => rows(200000),
+    },
+    {
+        name => 'toasted',
+        setup => 'CREATE TABLE bench (id int PRIMARY KEY, body text); '
+            . 'ALTER TABLE bench ALTER COLUMN body SET STORAGE EXTERNAL',
+        run => sprintf('INSERT INTO bench SELECT i, (SELECT string_agg(md5((i * k)::text), \'\') '
+                       . 'FROM generate_series(1, 1000) k) FROM generate_series(1, %d) i', rows(2000)),
+        rows => rows(2000),
+    },
+);
+
+my %json_options = map { my ($name, $value) = split /=/, $_, 2; ($name => $value // 'true') }
+                   grep { $_ ne '' } split /,/, $options;
+my $binary = (defined $json_options{format} && $json_options{format} ne 'json')
+          || (defined $json_options{compression} && $json_options{compression} ne 'none');
+
+my @plugins = (
+    {
+        name => 'json_decoding',
+        function => $binary ? 'pg_logical_slot_get_binary_changes' : 'pg_logical_slot_get_changes',
+        options => [ %json_options ],
+    },
+    {
+        name => 'test_decoding',
+        function => 'pg_logical_slot_get_changes',
+        options => [ 'include-xids' => '0', 'skip-empty-xacts' => '1' ],
+    },
+);
+
+my $bin = sub { $bindir ne '' ? "$bindir/$_[0]" : $_[0] };
+my $datadir = tempdir('json_decoding_bench_XXXX', TMPDIR => 1, CLEANUP => 1);
+my $port = 50000 + int(rand(10000));
+my $ticks = sysconf(_SC_CLK_TCK) || 100;
+
+sub run_command {
+    system(@_) == 0 or die "@_ failed\n";
+}
+
+run_command($bin->('initdb'), '-D', "$datadir/data", '-A', 'trust', '-U', 'postgres', '--no-sync', '-E', 'UTF8');
+
+open(my $version, '-|', $bin->('postgres'), '--version') or die "could not run postgres: $!\n";
+my ($major) = <$version> =~ /\s(\d+)/;
+close($version);
+
+open(my $conf, '>>', "$datadir/data/postgresql.conf") or die "could not open postgresql.conf: $!\n";
+print $conf <<"EOF";
+port = $port
+listen_addresses = ''
+unix_socket_directories = '$datadir'
+wal_level = logical
+max_replication_slots = 4
+max_wal_senders = 4
+shared_preload_libraries = 'json_decoding'
+fsync = off
+EOF
+# keep the transactions in memory, only decoding is measured
+print $conf "logical_decoding_work_mem = '1GB'\n" if $major >= 13;
+close($conf);
+
+run_command($bin->('pg_ctl'), '-D', "$datadir/data", '-l', "$datadir/server.log", '-w', '-s', 'start');
+
+END {
+    system($bin->('pg_ctl'), '-D', "$datadir/data", '-w', '-s', '-m', 'immediate', 'stop') if defined $datadir;
+}
+
+my @psql = ($bin->('psql'), '-X', '-q', '-A', '-t', '-v', 'ON_ERROR_STOP=1',
+            '-h', $datadir, '-p', $port, '-U', 'postgres', '-d', 'postgres');
+
+sub psql {
+    my @args = @_;
+    open(my $output, '-|', @psql, @args) or die "could not run psql: $!\n";
+    my @lines = <$output>;
+    close($output) or die "psql failed: @args\n";
+    chomp @lines;
+    return @lines;
+}
+
+sub quote_literal {
+    my ($value) = @_;
+    $value =~ s/'/''/g;
+    return "'$value'";
+}
+
+# utime + stime, in seconds, from a copy of /proc/<pid>/stat
+sub cpu_time {
+    my ($file) = @_;
+    open(my $stat, '<', $file) or return undef;
+    my $line = <$stat>;
+    close($stat);
+    return undef unless defined $line && $line =~ s/^.*\) //;
+    my @fields = split / /, $line;
+    return ($fields[11] + $fields[12]) / $ticks;
+}
+
+# Drain a slot in a session of its own, so its backend's CPU time is the
+# decoding's. The session copies the backend's /proc entry to a file before
+# and after the drain; \! doesn't interpolate psql variables, but its shell
+# sees what \setenv exported.
+sub drain {
+    my ($plugin, $slot) = @_;
+    my $args = join(', ', quote_literal($slot), 'NULL', 'NULL', map { quote_literal($_) } @{ $plugin->{options} });
+    my $script = "$datadir/drain.sql";
+
+    open(my $fh, '>', $script) or die "could not write $script: $!\n";
+    print $fh <<"EOF";
+SELECT pg_backend_pid() AS backend \\gset
+\\setenv BENCH_BACKEND :backend
+\\! cat /proc/\$BENCH_BACKEND/stat > '$datadir/cpu_start' 2>/dev/null
+SELECT extract(epoch FROM clock_timestamp());
+SELECT count(*) || ' ' || coalesce(sum(octet_length(data)), 0) FROM $plugin->{function}($args);
+SELECT extract(epoch FROM clock_timestamp());
+\\! cat /proc/\$BENCH_BACKEND/stat > '$datadir/cpu_end' 2>/dev/null
+EOF
+    close($fh);
+
+    unlink("$datadir/cpu_start", "$datadir/cpu_end");
+    my ($start, $result, $end) = psql('-f', $script);
+    my ($messages, $bytes) = split / /, $result;
+    my $cpu_start = cpu_time("$datadir/cpu_start");
+    my $cpu_end = cpu_time("$datadir/cpu_end");
+
+    return ($end - $start, defined $cpu_start && defined $cpu_end ? $cpu_end - $cpu_start : undef, $messages, $bytes);
+}
+
+printf "%-16s %-14s %10s %12s %10s %12s %14s\n",
+       'workload', 'plugin', 'rows', 'rows/s', 'bytes/row', 'cpu us/row', 'messages';
+
+foreach my $workload (@workloads) {
+    next if $only ne '' && $workload->{name} ne $only;
+
+    psql('-c', 'DROP TABLE IF EXISTS bench');
+    foreach my $plugin (@plugins) {
+        psql('-c', "SELECT pg_create_logical_replication_slot('bench_$plugin->{name}', '$plugin->{name}')");
+    }
+
+    psql('-c', $workload->{setup});
+    foreach my $plugin (@plugins) {
+        drain($plugin, "bench_$plugin->{name}");
+    }
+
+    psql('-c', $workload->{run});
+
+    foreach my $plugin (@plugins) {
+        my ($elapsed, $cpu, $messages, $bytes) = drain($plugin, "bench_$plugin->{name}");
+        my $rows = $workload->{rows};
+
+        printf "%-16s %-14s %10d %12.0f %10.1f %12s %14d\n",
+               $workload->{name},
+               $plugin->{name},
+               $rows,
+               $rows / ($elapsed || 1e-6),
+               $bytes / $rows,
+               defined $cpu ? sprintf('%.2f', $cpu * 1e6 / $rows) : 'n/a',
+               $messages;
+
+        psql('-c', "SELECT pg_drop_replication_slot('bench_$plugin->{name}')");
+    }
+}
@@ -0,0 +1,429 @@
+/*
+ * Row coalescing (coalesce-rows=true).
+ *
+ * The changes of a transaction are buffered per row, keyed by relation and
+ * replica identity key, and only their net effect is written at commit:
+ *
+ *   INSERT + UPDATE   INSERT of the last row
+ *   INSERT + DELETE   nothing
+ *   UPDATE + UPDATE   UPDATE to the last row
+ *   UPDATE + DELETE   DELETE
+ *   DELETE + INSERT   UPDATE to the inserted row
+ *
+ * Rows are written in the order they were first changed. Changes that can't
+ * be keyed (relations without a replica identity index, updates of the key
+ * itself) write out what is buffered and pass through, which keeps the
+ * stream in order. Once the buffered rows exceed coalesce-memory-kb the
+ * rest of the transaction passes through as well.
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+
+#if PG_VERSION_NUM >= 140000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "json_decoding_internal.h"
+
+#if PG_VERSION_NUM >= 130000
+#define fetch_external_attr(attr) detoast_external_attr(attr)
+#else
+#define fetch_external_attr(attr) heap_tuple_fetch_attr(attr)
+#endif
+
+/*
+ * The relation plan and descriptor the buffered rows of a relation were
+ * decoded with.
+ */
+typedef struct {
+    JsonDecodingRelation *relinfo;
+    uint32 generation;
+    TupleDesc tupdesc;
+} CoalesceRelation;
+
+typedef struct {
+    Oid relid;
+    int keylen;
+    char *key;
+} CoalesceKey;
+
+typedef struct {
+    CoalesceKey key;
+    CoalesceRelation *relation;
+    bool present;
+    ReorderBufferChangeType action;
+    /* the new row, or the old key for DELETE */
+    HeapTuple tuple;
+    XLogRecPtr lsn;
+} CoalesceEntry;
+
+/*
+ * Helper Methods.
+ */
+static void reset_rows(JsonDecodingData *data);
+
+static bool is_coalescible(JsonDecodingRelation *relinfo, ReorderBufferChange *change);
+
+static CoalesceRelation *get_relation(JsonDecodingData *data, JsonDecodingRelation *relinfo, TupleDesc tupdesc);
+
+static void build_key(CoalesceKey *key, JsonDecodingRelation *relinfo, TupleDesc tupdesc, HeapTuple tuple);
+
+static HeapTuple copy_tuple(TupleDesc tupdesc, HeapTuple tuple, HeapTuple previous);
+
+static void set_tuple(JsonDecodingData *data, CoalesceEntry *entry, HeapTuple tuple);
+
+static uint32 key_hash(const void *key, Size keysize);
+
+static int key_match(const void *key1, const void *key2, Size keysize);
+
+/*
+ * Implementation.
+ */
+
+void coalesce_init(LogicalDecodingContext *ctx, JsonDecodingData *data) {
+    data->coalesce_context = AllocSetContextCreate(ctx->context, "json decoding coalesced rows", ALLOCSET_DEFAULT_SIZES);
+    data->coalesce_overflow = false;
+    reset_rows(data);
+}
+
+void coalesce_append_change(LogicalDecodingContext *ctx,
+                            JsonDecodingData *data,
+                            JsonDecodingRelation *relinfo,
+                            TupleDesc tupdesc,
+                            ReorderBufferTXN *txn,
+                            ReorderBufferChange *change) {
+    HeapTuple oldtuple = change->data.tp.oldtuple != NULL ? &change->data.tp.oldtuple->tuple : NULL;
+    HeapTuple newtuple = change->data.tp.newtuple != NULL ? &change->data.tp.newtuple->tuple : NULL;
+    CoalesceEntry *entry;
+    CoalesceKey key;
+    MemoryContext old;
+    bool found;
+
+    if (data->coalesce_overflow || !is_coalescible(relinfo, change)) {
+        coalesce_flush(ctx, data, txn);
+        pg_output_change(ctx, data, relinfo, tupdesc, txn, change);
+        return;
+    }
+
+    build_key(&key, relinfo, tupdesc, change->action == REORDER_BUFFER_CHANGE_DELETE ? oldtuple : newtuple);
+
+    old = MemoryContextSwitchTo(data->coalesce_context);
+
+    entry = hash_search(data->coalesce_rows_hash, &key, HASH_ENTER, &found);
+
+    if (!found) {
+        entry->key.key = palloc(key.keylen);
+        memcpy(entry->key.key, key.key, key.keylen);
+        entry->relation = get_relation(data, relinfo, tupdesc);
+        entry->present = false;
+        entry->tuple = NULL;
+        data->coalesce_entries = lappend(data->coalesce_entries, entry);
+        data->coalesce_size += sizeof(CoalesceEntry) + key.keylen;
+    }
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            entry->action = entry->present && entry->action == REORDER_BUFFER_CHANGE_DELETE
+                            ? REORDER_BUFFER_CHANGE_UPDATE
+                            : REORDER_BUFFER_CHANGE_INSERT;
+            set_tuple(data, entry, copy_tuple(tupdesc, newtuple, NULL));
+            entry->present = true;
+            break;
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            if (!entry->present || entry->action == REORDER_BUFFER_CHANGE_DELETE) {
+                entry->action = REORDER_BUFFER_CHANGE_UPDATE;
+            }
+            set_tuple(data, entry, copy_tuple(tupdesc, newtuple, entry->present ? entry->tuple : NULL));
+            entry->present = true;
+            break;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            if (entry->present && entry->action == REORDER_BUFFER_CHANGE_INSERT) {
+                set_tuple(data, entry, NULL);
+                entry->present = false;
+            } else {
+                entry->action = REORDER_BUFFER_CHANGE_DELETE;
+                set_tuple(data, entry, copy_tuple(tupdesc, oldtuple, NULL));
+                entry->present = true;
+            }
+            break;
+        default:
+            Assert(false);
+    }
+    entry->lsn = change->lsn;
+
+    MemoryContextSwitchTo(old);
+
+    if (data->coalesce_size > (Size) data->coalesce_memory * 1024) {
+        coalesce_flush(ctx, data, txn);
+        data->coalesce_overflow = true;
+    }
+}
+
+/*
+ * A plan rebuild replaces the columns the buffered rows are written with,
+ * so write them out while the old plan is still there.
+ */
+void coalesce_check_plans(LogicalDecodingContext *ctx, JsonDecodingData *data, ReorderBufferTXN *txn) {
+    ListCell *cell;
+
+    foreach(cell, data->coalesce_relations)
+    {
+        CoalesceRelation *relation = lfirst(cell);
+
+        if (!relation->relinfo->valid) {
+            coalesce_flush(ctx, data, txn);
+            return;
+        }
+    }
+}
+
+/*
+ * Write the net effect of the buffered rows, in the order they were first
+ * changed.
+ */
+void coalesce_flush(LogicalDecodingContext *ctx, JsonDecodingData *data, ReorderBufferTXN *txn) {
+    ReorderBufferTupleBuf tuple;
+    ReorderBufferChange change;
+    ListCell *cell;
+    MemoryContext old;
+
+    if (data->coalesce_entries == NIL) {
+        return;
+    }
+
+    old = MemoryContextSwitchTo(data->context);
+
+    foreach(cell, data->coalesce_entries)
+    {
+        CoalesceEntry *entry = lfirst(cell);
+
+        if (!entry->present) {
+            continue;
+        }
+
+        MemSet(&change, 0, sizeof(change));
+        MemSet(&tuple, 0, sizeof(tuple));
+        tuple.tuple = *entry->tuple;
+
+        change.action = entry->action;
+        change.lsn = entry->lsn;
+        if (entry->action == REORDER_BUFFER_CHANGE_DELETE) {
+            change.data.tp.oldtuple = &tuple;
+        } else {
+            change.data.tp.newtuple = &tuple;
+        }
+
+        pg_output_change(ctx, data, entry->relation->relinfo, entry->relation->tupdesc, txn, &change);
+        MemoryContextReset(data->context);
+    }
+
+    MemoryContextSwitchTo(old);
+
+    MemoryContextReset(data->coalesce_context);
+    reset_rows(data);
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * An empty table in a fresh coalesce context; resetting the context frees
+ * the previous table with the rows.
+ */
+static void reset_rows(JsonDecodingData *data) {
+    HASHCTL ctl;
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(CoalesceKey);
+    ctl.entrysize = sizeof(CoalesceEntry);
+    ctl.hash = key_hash;
+    ctl.match = key_match;
+    ctl.hcxt = data->coalesce_context;
+    data->coalesce_rows_hash = hash_create("json decoding coalesced rows", 1024, &ctl,
+                                           HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+
+    data->coalesce_entries = NIL;
+    data->coalesce_relations = NIL;
+    data->coalesce_size = 0;
+}
+
+/*
+ * Rows need a unique key. Without REPLICA IDENTITY FULL an update only logs
+ * the old key when the key changes; such rows are not coalesced.
+ */
+static bool is_coalescible(JsonDecodingRelation *relinfo, ReorderBufferChange *change) {
+    if (!relinfo->keyed) {
+        return false;
+    }
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            return change->data.tp.newtuple != NULL;
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            return change->data.tp.newtuple != NULL && change->data.tp.oldtuple == NULL;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            return change->data.tp.oldtuple != NULL;
+        default:
+            return false;
+    }
+}
+
+static CoalesceRelation *get_relation(JsonDecodingData *data, JsonDecodingRelation *relinfo, TupleDesc tupdesc) {
+    CoalesceRelation *relation;
+    ListCell *cell;
+
+    foreach(cell, data->coalesce_relations)
+    {
+        relation = lfirst(cell);
+
+        if (relation->relinfo == relinfo && relation->generation == relinfo->generation) {
+            return relation;
+        }
+    }
+
+    relation = palloc(sizeof(CoalesceRelation));
+    relation->relinfo = relinfo;
+    relation->generation = relinfo->generation;
+    relation->tupdesc = CreateTupleDescCopy(tupdesc);
+    data->coalesce_relations = lappend(data->coalesce_relations, relation);
+
+    return relation;
+}
+
+/*
+ * The key is the text output of the identity columns, each prefixed with its
+ * length (-1 for null), in the conversion context.
+ */
+static void build_key(CoalesceKey *key, JsonDecodingRelation *relinfo, TupleDesc tupdesc, HeapTuple tuple) {
+    StringInfoData buf;
+    int32 len;
+    int natt;
+
+    initStringInfo(&buf);
+
+    heap_deform_tuple(tuple, tupdesc, relinfo->values, relinfo->nulls);
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+        char *output;
+
+        if (column->skip || !column->identity) {
+            continue;
+        }
+
+        if (relinfo->nulls[natt]) {
+            len = -1;
+            appendBinaryStringInfo(&buf, (char *) &len, sizeof(int32));
+            continue;
+        }
+
+        output = OidOutputFunctionCall(column->typoutput, relinfo->values[natt]);
+        len = strlen(output);
+        appendBinaryStringInfo(&buf, (char *) &len, sizeof(int32));
+        appendBinaryStringInfo(&buf, output, len);
+    }
+
+    key->relid = relinfo->relid;
+    key->keylen = buf.len;
+    key->key = buf.data;
+}
+
+/*
+ * Copy the row into the current context. Values the reorder buffer
+ * reassembled from TOAST chunks only live until the change is processed and
+ * are copied inline. Unchanged TOAST values of an update keep the value of
+ * the previous row.
+ */
+static HeapTuple copy_tuple(TupleDesc tupdesc, HeapTuple tuple, HeapTuple previous) {
+    Datum *values = palloc(sizeof(Datum) * Max(tupdesc->natts, 1));
+    bool *nulls = palloc(sizeof(bool) * Max(tupdesc->natts, 1));
+    bool *fetched = palloc0(sizeof(bool) * Max(tupdesc->natts, 1));
+    Datum *previous_values = NULL;
+    bool *previous_nulls = NULL;
+    HeapTuple result;
+    int natt;
+
+    heap_deform_tuple(tuple, tupdesc, values, nulls);
+
+    if (previous != NULL) {
+        previous_values = palloc(sizeof(Datum) * Max(tupdesc->natts, 1));
+        previous_nulls = palloc(sizeof(bool) * Max(tupdesc->natts, 1));
+        heap_deform_tuple(previous, tupdesc, previous_values, previous_nulls);
+    }
+
+    for (natt = 0; natt < tupdesc->natts; natt++) {
+        if (nulls[natt] || TupleDescAttr(tupdesc, natt)->attlen != -1) {
+            continue;
+        }
+
+        if (VARATT_IS_EXTERNAL_ONDISK(values[natt]) && previous != NULL && !previous_nulls[natt]) {
+            values[natt] = previous_values[natt];
+        } else if (VARATT_IS_EXTERNAL_INDIRECT(values[natt])) {
+            values[natt] = PointerGetDatum(fetch_external_attr((struct varlena *) DatumGetPointer(values[natt])));
+            fetched[natt] = true;
+        }
+    }
+
+    result = heap_form_tuple(tupdesc, values, nulls);
+
+    for (natt = 0; natt < tupdesc->natts; natt++) {
+        if (fetched[natt]) {
+            pfree(DatumGetPointer(values[natt]));
+        }
+    }
+
+    pfree(fetched);
+    pfree(values);
+    pfree(nulls);
+    if (previous != NULL) {
+        pfree(previous_values);
+        pfree(previous_nulls);
+    }
+
+    return result;
+}
+
+static void set_tuple(JsonDecodingData *data, CoalesceEntry *entry, HeapTuple tuple) {
+    if (entry->tuple != NULL) {
+        data->coalesce_size -= HEAPTUPLESIZE + entry->tuple->t_len;
+        heap_freetuple(entry->tuple);
+    }
+
+    entry->tuple = tuple;
+
+    if (tuple != NULL) {
+        data->coalesce_size += HEAPTUPLESIZE + tuple->t_len;
+    }
+}
+
+static uint32 key_hash(const void *key, Size keysize) {
+    const CoalesceKey *k = key;
+
+    return DatumGetUInt32(hash_uint32(k->relid)) ^ DatumGetUInt32(hash_any((const unsigned char *) k->key, k->keylen));
+}
+
+static int key_match(const void *key1, const void *key2, Size keysize) {
+    const CoalesceKey *k1 = key1;
+    const CoalesceKey *k2 = key2;
+
+    if (k1->relid != k2->relid || k1->keylen != k2->keylen) {
+        return 1;
+    }
+
+    return memcmp(k1->key, k2->key, k1->keylen);
+}
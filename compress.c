@@ -0,0 +1,156 @@
+/*
+ * Output compression (compression=pglz|lz4|zstd).
+ *
+ * Every message is replaced by a frame: a method byte, the uncompressed
+ * length as a uint32 in network byte order, then the payload. Messages that
+ * are too small or don't shrink are stored as they are, with method 0.
+ * lz4 and zstd are only available when the server was built with them.
+ *
+ * Compression is per message: batched output comes from format=arrow and
+ * format=copy, whose messages hold many rows. The row formats are not
+ * buffered up for it, since each of their messages is one change.
+ */
+#include "postgres.h"
+
+#include "common/pg_lzcompress.h"
+
+#include "port/pg_bswap.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "json_decoding_internal.h"
+
+#define COMPRESSION_HEADER_SIZE 5
+#define COMPRESSION_MIN_SIZE 64
+
+#define COMPRESSION_ZSTD_LEVEL 1
+
+#ifdef USE_ZSTD
+static ZSTD_CCtx *zstd_context = NULL;
+#endif
+
+/*
+ * Helper Methods.
+ */
+static int compress_block(JsonDecodingCompression method, const char *source, int len, StringInfo dest);
+
+static void write_header(char *header, JsonDecodingCompression method, int len);
+
+/*
+ * Implementation.
+ */
+
+bool compression_supported(JsonDecodingCompression method) {
+    switch (method) {
+        case COMPRESSION_LZ4:
+#ifdef USE_LZ4
+            return true;
+#else
+            return false;
+#endif
+        case COMPRESSION_ZSTD:
+#ifdef USE_ZSTD
+            return true;
+#else
+            return false;
+#endif
+        default:
+            return true;
+    }
+}
+
+/*
+ * Frame the message written to out since start, in place.
+ */
+void compress_output(JsonDecodingData *data, StringInfo out, int start) {
+    int len = out->len - start;
+    int compressed_len = -1;
+
+    if (len >= COMPRESSION_MIN_SIZE) {
+        compressed_len = compress_block(data->compression, out->data + start, len, &data->compress_buffer);
+    }
+
+    if (compressed_len < 0 || compressed_len >= len) {
+        enlargeStringInfo(out, COMPRESSION_HEADER_SIZE);
+        memmove(out->data + start + COMPRESSION_HEADER_SIZE, out->data + start, len);
+        write_header(out->data + start, COMPRESSION_NONE, len);
+        out->len += COMPRESSION_HEADER_SIZE;
+        out->data[out->len] = '\0';
+        return;
+    }
+
+    out->len = start;
+    enlargeStringInfo(out, COMPRESSION_HEADER_SIZE + compressed_len);
+    write_header(out->data + start, data->compression, len);
+    memcpy(out->data + start + COMPRESSION_HEADER_SIZE, data->compress_buffer.data, compressed_len);
+    out->len += COMPRESSION_HEADER_SIZE + compressed_len;
+    out->data[out->len] = '\0';
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * Compress into dest and return the compressed length, or -1 if the block
+ * could not be compressed.
+ */
+static int compress_block(JsonDecodingCompression method, const char *source, int len, StringInfo dest) {
+    int compressed_len = -1;
+
+    resetStringInfo(dest);
+
+    switch (method) {
+        case COMPRESSION_PGLZ:
+            enlargeStringInfo(dest, PGLZ_MAX_OUTPUT(len));
+            compressed_len = pglz_compress(source, len, dest->data, PGLZ_strategy_default);
+            break;
+#ifdef USE_LZ4
+        case COMPRESSION_LZ4:
+            enlargeStringInfo(dest, LZ4_compressBound(len));
+            compressed_len = LZ4_compress_default(source, dest->data, len, LZ4_compressBound(len));
+            if (compressed_len == 0) {
+                compressed_len = -1;
+            }
+            break;
+#endif
+#ifdef USE_ZSTD
+        case COMPRESSION_ZSTD:
+            {
+                size_t result;
+
+                if (zstd_context == NULL) {
+                    zstd_context = ZSTD_createCCtx();
+                    if (zstd_context == NULL) {
+                        ereport(ERROR,
+                                (errcode(ERRCODE_OUT_OF_MEMORY),
+                                        errmsg("out of memory")));
+                    }
+                }
+
+                enlargeStringInfo(dest, ZSTD_compressBound(len));
+                result = ZSTD_compressCCtx(zstd_context, dest->data, ZSTD_compressBound(len), source, len,
+                                           COMPRESSION_ZSTD_LEVEL);
+                compressed_len = ZSTD_isError(result) ? -1 : (int) result;
+            }
+            break;
+#endif
+        default:
+            break;
+    }
+
+    return compressed_len;
+}
+
+static void write_header(char *header, JsonDecodingCompression method, int len) {
+    uint32 n32 = pg_hton32((uint32) len);
+
+    header[0] = (char) method;
+    memcpy(header + 1, &n32, sizeof(uint32));
+}
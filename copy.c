@@ -0,0 +1,307 @@
+/*
+ * COPY output (format=copy).
+ *
+ * Consecutive inserts into the same relation are buffered as one PostgreSQL
+ * binary COPY stream and written as a single message once the run ends: at
+ * commit, when a change for another relation or an update/delete arrives,
+ * or when the buffer grows past COPY_FLUSH_BYTES. Changes therefore keep
+ * their original order. Updates and deletes are written as compact records
+ * with the replica identity key.
+ *
+ * Messages, with integers in network byte order like COPY itself:
+ *
+ *   'I' table columns stream   run of inserts; stream is the binary COPY
+ *                              data for COPY table (columns) FROM STDIN
+ *                              (FORMAT binary)
+ *   'U' table key columns row  update, with the new values of columns
+ *   'D' table key              delete
+ *
+ * table and column names are NUL-terminated and quoted for use in SQL.
+ * columns is an int16 count followed by the names, key is an int16 count
+ * followed by (name, field) pairs, row is an int16 count followed by fields.
+ * A field is an int32 length and the type's binary send output; the length
+ * is -1 for null and -2 for an unchanged TOAST value.
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+
+#include "libpq/pqformat.h"
+
+#include "utils/builtins.h"
+
+#include "json_decoding_internal.h"
+
+#define COPY_FLUSH_BYTES (8 * 1024 * 1024)
+
+#define COPY_FIELD_NULL (-1)
+#define COPY_FIELD_UNCHANGED_TOAST (-2)
+
+static const char copy_signature[11] = "PGCOPY\n\377\r\n";
+
+/*
+ * Helper Methods.
+ */
+static void start_run(JsonDecodingData *data, JsonDecodingRelation *relinfo);
+
+static void append_key(StringInfo s,
+                       JsonDecodingData *data,
+                       JsonDecodingRelation *relinfo,
+                       TupleDesc tupdesc,
+                       HeapTuple tuple);
+
+static void append_row(StringInfo s,
+                       JsonDecodingData *data,
+                       JsonDecodingRelation *relinfo,
+                       TupleDesc tupdesc,
+                       HeapTuple tuple);
+
+static void append_field(StringInfo s, JsonDecodingData *data, JsonDecodingColumn *column, Datum value, bool isnull);
+
+static void append_cstring(StringInfo s, const char *value);
+
+static bool is_copy_column(JsonDecodingColumn *column);
+
+/*
+ * Implementation.
+ */
+
+void copy_append_change(LogicalDecodingContext *ctx,
+                        JsonDecodingData *data,
+                        JsonDecodingRelation *relinfo,
+                        TupleDesc tupdesc,
+                        ReorderBufferChange *change) {
+    HeapTuple oldtuple = change->data.tp.oldtuple != NULL ? &change->data.tp.oldtuple->tuple : NULL;
+    HeapTuple newtuple = change->data.tp.newtuple != NULL ? &change->data.tp.newtuple->tuple : NULL;
+    StringInfo s;
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            if (newtuple == NULL) {
+                return;
+            }
+
+            if (data->copy_rows > 0 &&
+                (data->copy_relid != relinfo->relid || data->copy_generation != relinfo->generation)) {
+                copy_flush(ctx, data);
+            }
+
+            if (data->copy_rows == 0) {
+                start_run(data, relinfo);
+            }
+
+            append_row(&data->copy_buffer, data, relinfo, tupdesc, newtuple);
+            data->copy_rows++;
+
+            if (data->copy_buffer.len >= COPY_FLUSH_BYTES) {
+                copy_flush(ctx, data);
+            }
+            break;
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            copy_flush(ctx, data);
+
+            pg_output_prepare(ctx, true);
+            s = ctx->out;
+
+            pq_sendbyte(s, 'U');
+            append_cstring(s, relinfo->table_name);
+            append_key(s, data, relinfo, tupdesc, oldtuple != NULL ? oldtuple : newtuple);
+            append_row(s, data, relinfo, tupdesc, newtuple);
+
+            pg_output_write(ctx, true);
+            break;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            copy_flush(ctx, data);
+
+            pg_output_prepare(ctx, true);
+            s = ctx->out;
+
+            pq_sendbyte(s, 'D');
+            append_cstring(s, relinfo->table_name);
+            append_key(s, data, relinfo, tupdesc, oldtuple);
+
+            pg_output_write(ctx, true);
+            break;
+        default:
+            Assert(false);
+    }
+}
+
+/*
+ * Write out the pending run of inserts, if any.
+ */
+void copy_flush(LogicalDecodingContext *ctx, JsonDecodingData *data) {
+    int64 bytes = data->counters.bytes;
+
+    if (data->copy_rows == 0) {
+        return;
+    }
+
+    /* COPY file trailer */
+    pq_sendint16(&data->copy_buffer, -1);
+
+    pg_output_prepare(ctx, true);
+    appendBinaryStringInfo(ctx->out, data->copy_buffer.data, data->copy_buffer.len);
+    pg_output_write(ctx, true);
+
+    /* the run belongs to the relation it was started for */
+    bytes = data->counters.bytes - bytes;
+    data->flushed_bytes += bytes;
+    if (data->relation_stats) {
+        data->copy_relinfo->stats_bytes += bytes;
+    }
+
+    resetStringInfo(&data->copy_buffer);
+    data->copy_rows = 0;
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * The message header and COPY file header are written when the run starts,
+ * so the run does not depend on the relation plan still being current when
+ * it is flushed.
+ */
+static void start_run(JsonDecodingData *data, JsonDecodingRelation *relinfo) {
+    StringInfo s = &data->copy_buffer;
+    int ncolumns = 0;
+    int natt;
+
+    data->copy_relinfo = relinfo;
+    data->copy_relid = relinfo->relid;
+    data->copy_generation = relinfo->generation;
+
+    pq_sendbyte(s, 'I');
+    append_cstring(s, relinfo->table_name);
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (is_copy_column(&relinfo->columns[natt])) {
+            ncolumns++;
+        }
+    }
+
+    pq_sendint16(s, ncolumns);
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (is_copy_column(&relinfo->columns[natt])) {
+            append_cstring(s, quote_identifier(relinfo->columns[natt].name));
+        }
+    }
+
+    /* signature, flags, header extension length */
+    pq_sendbytes(s, copy_signature, sizeof(copy_signature));
+    pq_sendint32(s, 0);
+    pq_sendint32(s, 0);
+}
+
+/*
+ * The replica identity columns of the tuple; every column with REPLICA
+ * IDENTITY FULL. Without a tuple (REPLICA IDENTITY NOTHING) the key is empty.
+ */
+static void append_key(StringInfo s,
+                       JsonDecodingData *data,
+                       JsonDecodingRelation *relinfo,
+                       TupleDesc tupdesc,
+                       HeapTuple tuple) {
+    int nkeys = 0;
+    int natt;
+
+    if (tuple == NULL) {
+        pq_sendint16(s, 0);
+        return;
+    }
+
+    heap_deform_tuple(tuple, tupdesc, relinfo->values, relinfo->nulls);
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (is_copy_column(&relinfo->columns[natt]) && relinfo->columns[natt].identity) {
+            nkeys++;
+        }
+    }
+
+    pq_sendint16(s, nkeys);
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+
+        if (!is_copy_column(column) || !column->identity) {
+            continue;
+        }
+
+        append_cstring(s, quote_identifier(column->name));
+        append_field(s, data, column, relinfo->values[natt], relinfo->nulls[natt]);
+    }
+}
+
+/*
+ * A COPY binary tuple: field count and fields, in column order.
+ */
+static void append_row(StringInfo s,
+                       JsonDecodingData *data,
+                       JsonDecodingRelation *relinfo,
+                       TupleDesc tupdesc,
+                       HeapTuple tuple) {
+    int ncolumns = 0;
+    int natt;
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (is_copy_column(&relinfo->columns[natt])) {
+            ncolumns++;
+        }
+    }
+
+    pq_sendint16(s, ncolumns);
+
+    if (tuple == NULL) {
+        for (natt = 0; natt < ncolumns; natt++) {
+            pq_sendint32(s, COPY_FIELD_NULL);
+        }
+        return;
+    }
+
+    heap_deform_tuple(tuple, tupdesc, relinfo->values, relinfo->nulls);
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+
+        if (is_copy_column(column)) {
+            append_field(s, data, column, relinfo->values[natt], relinfo->nulls[natt]);
+        }
+    }
+}
+
+static void append_field(StringInfo s, JsonDecodingData *data, JsonDecodingColumn *column, Datum value, bool isnull) {
+    bytea *output;
+
+    if (isnull) {
+        pq_sendint32(s, COPY_FIELD_NULL);
+        return;
+    }
+
+    if (column->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(value) && !data->include_toast_datum) {
+        pq_sendint32(s, COPY_FIELD_UNCHANGED_TOAST);
+        return;
+    }
+
+    if (column->typisvarlena) {
+        value = PointerGetDatum(PG_DETOAST_DATUM(value));
+    }
+
+    output = OidSendFunctionCall(column->typsend, value);
+    pq_sendint32(s, VARSIZE(output) - VARHDRSZ);
+    pq_sendbytes(s, VARDATA(output), VARSIZE(output) - VARHDRSZ);
+}
+
+/*
+ * NUL-terminated, without the client encoding conversion pq_sendstring does.
+ */
+static void append_cstring(StringInfo s, const char *value) {
+    pq_sendbytes(s, value, strlen(value) + 1);
+}
+
+/*
+ * Generated columns can't be written by COPY or UPDATE on the receiving side.
+ */
+static bool is_copy_column(JsonDecodingColumn *column) {
+    return !column->skip && !column->generated;
+}
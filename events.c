@@ -0,0 +1,177 @@
+/*
+ * Control events: transaction boundaries and other messages that are not
+ * row changes.
+ *
+ * An event is a flat object whose first field is the event type under the
+ * key-type key. It is a MessagePack map with format=msgpack and a JSON
+ * object with every other format. With format=avro the schema messages are
+ * JSON objects too; consumers tell rows apart by the single-object marker
+ * 0xC3 0x01, and events from schema messages by the key-type key.
+ */
+#include "postgres.h"
+
+#include "libpq/pqformat.h"
+
+#include "mb/pg_wchar.h"
+
+#include "port/pg_bswap.h"
+
+#include "utils/builtins.h"
+#include "utils/json.h"
+
+#include "json_decoding_internal.h"
+
+/*
+ * Helper Methods.
+ */
+static void event_key(JsonDecodingEvent *event, const char *key);
+
+/*
+ * Implementation.
+ */
+
+void event_start(JsonDecodingEvent *event, JsonDecodingData *data, StringInfo s, const char *type) {
+    event->data = data;
+    event->s = s;
+    event->nfields = 0;
+
+    if (data->format == FORMAT_MSGPACK) {
+        /* map16, the count is filled in by event_end */
+        pq_sendbyte(s, 0xde);
+        event->count_position = s->len;
+        pq_sendint16(s, 0);
+    } else {
+        appendStringInfoString(s, data->compact ? "{" : "{ ");
+    }
+
+    event_add_string(event, data->key_type, type);
+}
+
+void event_add_string(JsonDecodingEvent *event, const char *key, const char *value) {
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_cstring(event->s, value);
+    } else {
+        escape_json(event->s, value);
+    }
+}
+
+void event_add_uint(JsonDecodingEvent *event, const char *key, uint64 value) {
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_uint(event->s, value);
+    } else {
+        appendStringInfo(event->s, UINT64_FORMAT, value);
+    }
+}
+
+void event_add_strings(JsonDecodingEvent *event, const char *key, const char **values, int count) {
+    int i;
+
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_array(event->s, count);
+        for (i = 0; i < count; i++) {
+            msgpack_write_cstring(event->s, values[i]);
+        }
+    } else {
+        appendStringInfoChar(event->s, '[');
+        for (i = 0; i < count; i++) {
+            if (i > 0) {
+                appendStringInfoString(event->s, event->data->fragments.separator);
+            }
+            escape_json(event->s, values[i]);
+        }
+        appendStringInfoChar(event->s, ']');
+    }
+}
+
+/*
+ * Arbitrary bytes: binary in MessagePack. JSON gets a string when they are
+ * valid text in the database encoding and bytea's hex format otherwise.
+ */
+void event_add_bytes(JsonDecodingEvent *event, const char *key, const char *value, Size len) {
+    char *text;
+
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_binary(event->s, value, len);
+    } else if (pg_verifymbstr(value, len, true)) {
+        text = pnstrdup(value, len);
+        escape_json(event->s, text);
+        pfree(text);
+    } else {
+        enlargeStringInfo(event->s, len * 2 + 4);
+        appendStringInfoString(event->s, "\"\\\\x");
+        event->s->len += hex_encode(value, len, event->s->data + event->s->len);
+        appendStringInfoChar(event->s, '"');
+    }
+}
+
+void event_add_bool(JsonDecodingEvent *event, const char *key, bool value) {
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_bool(event->s, value);
+    } else {
+        appendStringInfoString(event->s, value ? "true" : "false");
+    }
+}
+
+/*
+ * LSNs are integers in MessagePack and "X/X" strings, as pg_lsn prints
+ * them, in JSON.
+ */
+void event_add_lsn(JsonDecodingEvent *event, const char *key, XLogRecPtr value) {
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_uint(event->s, value);
+    } else {
+        appendStringInfo(event->s, "\"%X/%X\"", (uint32) (value >> 32), (uint32) value);
+    }
+}
+
+void event_add_timestamp(JsonDecodingEvent *event, const char *key, TimestampTz value) {
+    event_key(event, key);
+
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_timestamp(event->s, value);
+    } else {
+        appendStringInfoChar(event->s, '"');
+        appendStringInfoString(event->s, timestamptz_to_str(value));
+        appendStringInfoChar(event->s, '"');
+    }
+}
+
+void event_end(JsonDecodingEvent *event) {
+    if (event->data->format == FORMAT_MSGPACK) {
+        uint16 n16 = pg_hton16((uint16) event->nfields);
+
+        memcpy(event->s->data + event->count_position, &n16, sizeof(uint16));
+    } else {
+        appendStringInfoString(event->s, event->data->fragments.close);
+    }
+}
+
+/*
+ * Helper Implementations.
+ */
+
+static void event_key(JsonDecodingEvent *event, const char *key) {
+    if (event->data->format == FORMAT_MSGPACK) {
+        msgpack_write_cstring(event->s, key);
+    } else {
+        if (event->nfields > 0) {
+            appendStringInfoString(event->s, event->data->fragments.separator);
+        }
+        escape_json(event->s, key);
+        appendStringInfoString(event->s, event->data->compact ? ":" : ": ");
+    }
+
+    event->nfields++;
+}
@@ -0,0 +1,510 @@
+/*
+ * Parallel initial export (json_decoding_export).
+ *
+ * Writes the rows of a set of tables, as seen by a snapshot exported when a
+ * replication slot was created, to files in a server directory in the
+ * plugin's JSON format: one insert per line, as json_decoding_row writes
+ * it. Streaming the slot then continues exactly where the files end.
+ *
+ * Each table is split into block ranges and the ranges are handed out to
+ * dynamic background workers through a dynamic shared memory segment. Every
+ * worker imports the snapshot and writes the ranges it takes to their own
+ * files, <schema>.<table>.<part>.json with the names percent-encoded,
+ * fsynced once written. The calling backend keeps the tables locked and
+ * waits for the workers.
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+
+#include "access/xact.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/tableam.h"
+#endif
+#include "access/heapam.h"
+
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+
+#include "executor/spi.h"
+
+#include "miscadmin.h"
+
+#include "port/atomics.h"
+
+#include "postmaster/bgworker.h"
+
+#include "storage/bufmgr.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+
+#include "json_decoding_internal.h"
+
+/* smallest block range worth a task of its own, 8MB with 8kB blocks */
+#define EXPORT_MIN_BLOCKS 1024
+
+#define EXPORT_MAX_WORKERS 64
+
+#define EXPORT_TABLES_QUERY \
+    "SELECT c.oid FROM pg_catalog.pg_class c " \
+    "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace " \
+    "WHERE c.relkind = 'r' AND n.nspname <> 'information_schema' AND n.nspname !~ '^pg_' " \
+    "ORDER BY c.oid"
+
+/* nblocks is InvalidBlockNumber for a table scanned whole */
+typedef struct {
+    Oid relid;
+    int part;
+    BlockNumber start_block;
+    BlockNumber nblocks;
+} ExportTask;
+
+/*
+ * The shared memory segment: this header, the tasks and the options array.
+ */
+typedef struct {
+    Oid database;
+    Oid user;
+    char snapshot[NAMEDATALEN];
+    char directory[MAXPGPATH];
+    Size options_offset;
+    int ntasks;
+    pg_atomic_uint32 next_task;
+    pg_atomic_uint32 completed;
+    pg_atomic_uint64 rows;
+    ExportTask tasks[FLEXIBLE_ARRAY_MEMBER];
+} ExportShared;
+
+PG_FUNCTION_INFO_V1(json_decoding_export);
+
+PGDLLEXPORT void json_decoding_export_main(Datum main_arg);
+
+/*
+ * Helper Methods.
+ */
+static List *export_tables(ArrayType *tables);
+
+static List *export_tasks(List *relids, int workers);
+
+static void export_task(ExportShared *shared, JsonDecodingData *data, ExportTask *task);
+
+static char *export_file_name(ExportShared *shared, Relation relation, int part);
+
+static void append_file_name_part(StringInfo s, const char *name);
+
+/*
+ * Implementation.
+ */
+
+Datum json_decoding_export(PG_FUNCTION_ARGS) {
+    char *snapshot;
+    char *directory;
+    int workers;
+    ArrayType *options;
+    List *relids;
+    List *tasks;
+    ListCell *lc;
+    Size size;
+    dsm_segment *segment;
+    ExportShared *shared;
+    BackgroundWorkerHandle **handles;
+    BackgroundWorker worker;
+    struct stat st;
+    uint64 rows;
+    int launched;
+    int i;
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(4)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                        errmsg("only the tables argument may be null")));
+    }
+
+    snapshot = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    directory = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    workers = PG_GETARG_INT32(2);
+    options = PG_GETARG_ARRAYTYPE_P(4);
+
+    if (!superuser()) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                        errmsg("must be superuser to export tables to files")));
+    }
+
+    if (workers < 1 || workers > EXPORT_MAX_WORKERS) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("workers must be between 1 and %d", EXPORT_MAX_WORKERS)));
+    }
+
+    if (strlen(snapshot) >= NAMEDATALEN || strlen(directory) >= MAXPGPATH) {
+        ereport(ERROR,
+                (errcode(ERRCODE_NAME_TOO_LONG),
+                        errmsg("snapshot identifier or directory name is too long")));
+    }
+
+    if (stat(directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_FILE),
+                        errmsg("\"%s\" is not a directory", directory)));
+    }
+
+    /* report bad options here, rather than once per worker */
+    (void) sql_decoding_data(options);
+
+    relids = export_tables(PG_ARGISNULL(3) ? NULL : PG_GETARG_ARRAYTYPE_P(3));
+    tasks = export_tasks(relids, workers);
+
+    size = MAXALIGN(offsetof(ExportShared, tasks) + sizeof(ExportTask) * list_length(tasks));
+    segment = dsm_create(size + VARSIZE(options), 0);
+    shared = dsm_segment_address(segment);
+
+    shared->database = MyDatabaseId;
+    shared->user = GetUserId();
+    strlcpy(shared->snapshot, snapshot, NAMEDATALEN);
+    strlcpy(shared->directory, directory, MAXPGPATH);
+    shared->options_offset = size;
+    shared->ntasks = list_length(tasks);
+    pg_atomic_init_u32(&shared->next_task, 0);
+    pg_atomic_init_u32(&shared->completed, 0);
+    pg_atomic_init_u64(&shared->rows, 0);
+
+    i = 0;
+    foreach (lc, tasks) {
+        shared->tasks[i++] = *(ExportTask *) lfirst(lc);
+    }
+    memcpy((char *) shared + size, options, VARSIZE(options));
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "json_decoding");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "json_decoding_export_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "json_decoding export worker");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "json_decoding export");
+    worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(segment));
+    worker.bgw_notify_pid = MyProcPid;
+
+    workers = Min(workers, shared->ntasks);
+    handles = palloc0(sizeof(BackgroundWorkerHandle *) * Max(workers, 1));
+
+    for (launched = 0; launched < workers; launched++) {
+        if (!RegisterDynamicBackgroundWorker(&worker, &handles[launched])) {
+            break;
+        }
+    }
+
+    if (launched == 0 && shared->ntasks > 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                        errmsg("could not register background process"),
+                        errhint("You may need to increase max_worker_processes.")));
+    }
+
+    PG_TRY();
+    {
+        for (i = 0; i < launched; i++) {
+            if (WaitForBackgroundWorkerShutdown(handles[i]) == BGWH_POSTMASTER_DIED) {
+                ereport(ERROR,
+                        (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                                errmsg("postmaster exited during the export")));
+            }
+        }
+    }
+    PG_CATCH();
+    {
+        for (i = 0; i < launched; i++) {
+            TerminateBackgroundWorker(handles[i]);
+        }
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    if (pg_atomic_read_u32(&shared->completed) < (uint32) shared->ntasks) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                        errmsg("export failed: %u of %d table ranges were written",
+                               pg_atomic_read_u32(&shared->completed), shared->ntasks),
+                        errhint("The export workers logged the cause in the server log.")));
+    }
+
+    rows = pg_atomic_read_u64(&shared->rows);
+    dsm_detach(segment);
+
+    PG_RETURN_INT64((int64) rows);
+}
+
+void json_decoding_export_main(Datum main_arg) {
+    dsm_segment *segment;
+    ExportShared *shared;
+    JsonDecodingData *data;
+    uint32 i;
+
+    BackgroundWorkerUnblockSignals();
+
+    segment = dsm_attach(DatumGetUInt32(main_arg));
+    if (segment == NULL) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                        errmsg("could not map dynamic shared memory segment")));
+    }
+    shared = dsm_segment_address(segment);
+
+    BackgroundWorkerInitializeConnectionByOid(shared->database, shared->user, 0);
+
+    StartTransactionCommand();
+    XactIsoLevel = XACT_REPEATABLE_READ;
+    ImportSnapshot(shared->snapshot);
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    data = sql_decoding_data((ArrayType *) ((char *) shared + shared->options_offset));
+
+    while ((i = pg_atomic_fetch_add_u32(&shared->next_task, 1)) < (uint32) shared->ntasks) {
+        export_task(shared, data, &shared->tasks[i]);
+        pg_atomic_fetch_add_u32(&shared->completed, 1);
+    }
+
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    dsm_detach(segment);
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * The given tables, or every user table when none are.
+ */
+static List *export_tables(ArrayType *tables) {
+    MemoryContext caller = CurrentMemoryContext;
+    List *relids = NIL;
+    Datum *datums;
+    bool *nulls;
+    int ndatums;
+    int i;
+
+    if (tables != NULL) {
+        deconstruct_array(tables, REGCLASSOID, sizeof(Oid), true, 'i', &datums, &nulls, &ndatums);
+        for (i = 0; i < ndatums; i++) {
+            if (!nulls[i]) {
+                relids = lappend_oid(relids, DatumGetObjectId(datums[i]));
+            }
+        }
+        return relids;
+    }
+
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        elog(ERROR, "SPI_connect failed");
+    }
+
+    if (SPI_execute(EXPORT_TABLES_QUERY, true, 0) != SPI_OK_SELECT) {
+        elog(ERROR, "could not list the tables to export");
+    }
+
+    for (i = 0; i < (int) SPI_processed; i++) {
+        bool isnull;
+        Datum relid = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull);
+        MemoryContext old = MemoryContextSwitchTo(caller);
+
+        relids = lappend_oid(relids, DatumGetObjectId(relid));
+        MemoryContextSwitchTo(old);
+    }
+
+    SPI_finish();
+
+    return relids;
+}
+
+/*
+ * Split the tables into block ranges of at least EXPORT_MIN_BLOCKS, at most
+ * one per worker. The tables stay locked until the end of the transaction,
+ * and every row the snapshot sees is below the size they have now. Scan
+ * limits are a heap feature, so tables of other access methods are a
+ * single task scanning them whole.
+ */
+static List *export_tasks(List *relids, int workers) {
+    List *tasks = NIL;
+    ListCell *lc;
+
+    foreach (lc, relids) {
+        Relation relation = relation_open(lfirst_oid(lc), AccessShareLock);
+        BlockNumber nblocks;
+        BlockNumber range;
+        BlockNumber start;
+        int part = 0;
+
+        if (RelationGetForm(relation)->relkind != RELKIND_RELATION) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                            errmsg("\"%s\" is not a table", RelationGetRelationName(relation))));
+        }
+
+#if PG_VERSION_NUM >= 120000
+        if (relation->rd_tableam != GetHeapamTableAmRoutine()) {
+            ExportTask *task = palloc(sizeof(ExportTask));
+
+            task->relid = RelationGetRelid(relation);
+            task->part = 0;
+            task->start_block = 0;
+            task->nblocks = InvalidBlockNumber;
+            tasks = lappend(tasks, task);
+
+            relation_close(relation, NoLock);
+            continue;
+        }
+#endif
+
+        nblocks = RelationGetNumberOfBlocks(relation);
+        range = Max((nblocks + workers - 1) / workers, EXPORT_MIN_BLOCKS);
+
+        start = 0;
+        do {
+            ExportTask *task = palloc(sizeof(ExportTask));
+
+            task->relid = RelationGetRelid(relation);
+            task->part = part++;
+            task->start_block = start;
+            task->nblocks = Min(range, nblocks - start);
+            tasks = lappend(tasks, task);
+
+            start += task->nblocks;
+        } while (start < nblocks);
+
+        relation_close(relation, NoLock);
+    }
+
+    return tasks;
+}
+
+static void export_task(ExportShared *shared, JsonDecodingData *data, ExportTask *task) {
+    JsonDecodingRelation *relinfo;
+    Relation relation;
+    StringInfoData s;
+    HeapTuple tuple;
+    char *path;
+    FILE *file;
+    uint64 rows = 0;
+#if PG_VERSION_NUM >= 120000
+    TableScanDesc scan;
+    TupleTableSlot *slot;
+#else
+    HeapScanDesc scan;
+#endif
+
+    relation = relation_open(task->relid, AccessShareLock);
+    relinfo = sql_relation_plan(data, relation);
+
+    path = export_file_name(shared, relation, task->part);
+    file = AllocateFile(path, PG_BINARY_W);
+    if (file == NULL) {
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                        errmsg("could not open file \"%s\" for writing: %m", path)));
+    }
+
+    initStringInfo(&s);
+
+    /* no synchronized scans, they would not start at the range */
+#if PG_VERSION_NUM >= 120000
+    scan = table_beginscan_strat(relation, GetActiveSnapshot(), 0, NULL, true, false);
+    if (task->nblocks != InvalidBlockNumber) {
+        heap_setscanlimits(scan, task->start_block, task->nblocks);
+    }
+    slot = table_slot_create(relation, NULL);
+
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
+        tuple = ExecFetchSlotHeapTuple(slot, false, NULL);
+#else
+    scan = heap_beginscan_strat(relation, GetActiveSnapshot(), 0, NULL, true, false);
+    heap_setscanlimits(scan, task->start_block, task->nblocks);
+
+    while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+#endif
+        resetStringInfo(&s);
+        data->xact_changes++;
+        sql_row_to_json(&s, data, relinfo, relation, tuple);
+        appendStringInfoChar(&s, '\n');
+
+        if (fwrite(s.data, 1, s.len, file) != (size_t) s.len) {
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                            errmsg("could not write to file \"%s\": %m", path)));
+        }
+        rows++;
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+#if PG_VERSION_NUM >= 120000
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+#else
+    heap_endscan(scan);
+#endif
+
+    if (fflush(file) != 0 || pg_fsync(fileno(file)) != 0) {
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                        errmsg("could not fsync file \"%s\": %m", path)));
+    }
+
+    if (FreeFile(file) != 0) {
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                        errmsg("could not close file \"%s\": %m", path)));
+    }
+
+    pg_atomic_fetch_add_u64(&shared->rows, rows);
+
+    MemoryContextDelete(relinfo->context);
+    pfree(relinfo);
+    pfree(s.data);
+    pfree(path);
+
+    relation_close(relation, AccessShareLock);
+}
+
+/*
+ * <directory>/<schema>.<table>.<part>.json, with the names percent-encoded
+ * so that neither can contain the '.' between them or leave the directory.
+ */
+static char *export_file_name(ExportShared *shared, Relation relation, int part) {
+    StringInfoData path;
+
+    initStringInfo(&path);
+    appendStringInfo(&path, "%s/", shared->directory);
+    append_file_name_part(&path, get_namespace_name(RelationGetNamespace(relation)));
+    appendStringInfoChar(&path, '.');
+    append_file_name_part(&path, RelationGetRelationName(relation));
+    appendStringInfo(&path, ".%d.json", part);
+
+    return path.data;
+}
+
+/*
+ * Letters, digits, '_', '-' and non-ASCII bytes are kept; every other byte
+ * becomes %XX.
+ */
+static void append_file_name_part(StringInfo s, const char *name) {
+    const unsigned char *c;
+
+    for (c = (const unsigned char *) name; *c != '\0'; c++) {
+        if ((*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') ||
+            *c == '_' || *c == '-' || *c >= 0x80) {
+            appendStringInfoChar(s, (char) *c);
+        } else {
+            appendStringInfo(s, "%%%02X", *c);
+        }
+    }
+}
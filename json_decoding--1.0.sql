@@ -0,0 +1,67 @@
+/* json_decoding--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION json_decoding" to load this file. \quit
+
+CREATE FUNCTION json_decoding_row(rel regclass, rec record, VARIADIC options text[] DEFAULT '{}')
+RETURNS text
+AS 'MODULE_PATHNAME', 'json_decoding_row'
+LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION json_decoding_table(rel regclass, VARIADIC options text[] DEFAULT '{}')
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'json_decoding_table'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION json_decoding_export(snapshot text,
+                                     directory text,
+                                     workers integer DEFAULT 4,
+                                     tables regclass[] DEFAULT NULL,
+                                     options text[] DEFAULT '{}')
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'json_decoding_export'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION json_decoding_export(text, text, integer, regclass[], text[]) FROM PUBLIC;
+
+CREATE FUNCTION json_decoding_stats(OUT slot_name name,
+                                    OUT inserts bigint,
+                                    OUT updates bigint,
+                                    OUT deletes bigint,
+                                    OUT truncates bigint,
+                                    OUT messages bigint,
+                                    OUT transactions bigint,
+                                    OUT filtered bigint,
+                                    OUT bytes bigint,
+                                    OUT max_message_bytes bigint,
+                                    OUT serialize_time double precision,
+                                    OUT detoasted bigint,
+                                    OUT detoasted_bytes bigint,
+                                    OUT decode_lag bigint,
+                                    OUT slot_exists boolean,
+                                    OUT stats_reset timestamp with time zone)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'json_decoding_stats'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE VIEW pg_stat_json_decoding AS
+    SELECT * FROM json_decoding_stats();
+
+CREATE FUNCTION json_decoding_stats_reset(slot_name name DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'json_decoding_stats_reset'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION json_decoding_stats_reset(name) FROM PUBLIC;
+
+CREATE FUNCTION json_decoding_histograms(OUT slot_name name,
+                                         OUT histogram text,
+                                         OUT lower_bound bigint,
+                                         OUT upper_bound bigint,
+                                         OUT count bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'json_decoding_histograms'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE VIEW pg_stat_json_decoding_histograms AS
+    SELECT * FROM json_decoding_histograms();
@@ -1,14 +1,54 @@
 #include "postgres.h"
 
+#include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "access/transam.h"
+#include "access/xact.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/tableam.h"
+#else
+#include "access/heapam.h"
+#endif
+
+#include "catalog/dependency.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
 
+#include "commands/extension.h"
+
+#include "datatype/timestamp.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "nodes/bitmapset.h"
+#include "nodes/makefuncs.h"
+
 #include "replication/logical.h"
 #include "replication/origin.h"
 
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/json.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "json_decoding.h"
+#include "json_decoding_internal.h"
+#include "ryu.h"
 
 PG_MODULE_MAGIC;
 
@@ -16,18 +56,13 @@ extern void _PG_init(void);
 
 extern void _PG_output_plugin_init(OutputPluginCallbacks *cb);
 
-typedef struct {
-    MemoryContext context;
-    bool include_xids;
-    bool include_timestamp;
-    bool skip_empty_xacts;
-    bool xact_wrote_changes;
-    bool only_local;
-    bool include_messages;
-    bool include_toast_datum;
-    TransactionId xid;
-    TimestampTz commit_time;
-} JsonDecodingData;
+PG_FUNCTION_INFO_V1(json_decoding_row);
+
+PG_FUNCTION_INFO_V1(json_decoding_table);
+
+static MemoryContext relation_cache_context = NULL;
+static HTAB *relation_cache = NULL;
+static bool relation_cache_callbacks_registered = false;
 
 /*
  * Callback Methods.
@@ -47,6 +82,35 @@ static void pg_decode_commit(LogicalDecodingContext *ctx,
                              ReorderBufferTXN *txn,
                              XLogRecPtr commit_lsn);
 
+#if PG_VERSION_NUM >= 140000
+static void pg_decode_prepare(LogicalDecodingContext *ctx,
+                              ReorderBufferTXN *txn,
+                              XLogRecPtr prepare_lsn);
+
+static void pg_decode_commit_prepared(LogicalDecodingContext *ctx,
+                                      ReorderBufferTXN *txn,
+                                      XLogRecPtr commit_lsn);
+
+static void pg_decode_rollback_prepared(LogicalDecodingContext *ctx,
+                                        ReorderBufferTXN *txn,
+                                        XLogRecPtr prepare_end_lsn,
+                                        TimestampTz prepare_time);
+#endif
+
+static void pg_decode_truncate(LogicalDecodingContext *ctx,
+                               ReorderBufferTXN *txn,
+                               int nrelations,
+                               Relation relations[],
+                               ReorderBufferChange *change);
+
+static void pg_decode_message(LogicalDecodingContext *ctx,
+                              ReorderBufferTXN *txn,
+                              XLogRecPtr message_lsn,
+                              bool transactional,
+                              const char *prefix,
+                              Size message_size,
+                              const char *message);
+
 static bool pg_decode_filter(LogicalDecodingContext *ctx,
                              RepOriginId origin_id);
 
@@ -55,11 +119,72 @@ static void pg_decode_shutdown(LogicalDecodingContext *ctx);
 /*
  * Helper Methods.
  */
+static void change_to_json(StringInfo s,
+                           JsonDecodingData *data,
+                           JsonDecodingRelation *relinfo,
+                           TupleDesc tupdesc,
+                           ReorderBufferTXN *txn,
+                           ReorderBufferChange *change);
+
 static void tuple_to_json_fields(StringInfo s,
+                                 JsonDecodingData *data,
+                                 JsonDecodingRelation *relinfo,
                                  TupleDesc tupdesc,
                                  HeapTuple tuple,
                                  bool skip_nulls,
-                                 bool include_toast_datum);
+                                 bool first);
+
+static void render_fragments(JsonDecodingData *data);
+
+static char *render_key(JsonDecodingData *data, const char *prefix, const char *key, const char *suffix);
+
+static void relation_cache_init(LogicalDecodingContext *ctx);
+
+static void relation_cache_reset_cb(void *arg);
+
+static void relation_cache_log_stats(void);
+
+static void relation_cache_invalidate_cb(Datum arg, Oid relid);
+
+static void type_cache_invalidate_cb(Datum arg, int cacheid, uint32 hashvalue);
+
+static JsonDecodingRelation *get_relation_plan(JsonDecodingData *data, Relation relation);
+
+static void build_relation_plan(JsonDecodingData *data,
+                                JsonDecodingRelation *relinfo,
+                                Relation relation,
+                                MemoryContext parent);
+
+static JsonDecodingColumnKind get_column_kind(Oid typid);
+
+static JsonDecodingTypeFormatter lookup_type_formatter(Oid typid, bool *send);
+
+static void float4_to_json(StringInfo s, Oid typid, Datum value);
+
+static void float8_to_json(StringInfo s, Oid typid, Datum value);
+
+static void hstore_to_json(StringInfo s, Oid typid, Datum value);
+
+static void vector_to_json(StringInfo s, Oid typid, Datum value);
+
+static void geometry_to_json(StringInfo s, Oid typsend, Datum value);
+
+/*
+ * Built-in formatters, by type name and the extension that has to own the
+ * type; a registered formatter for the same type takes their place. With
+ * send set the formatter is called with the type's send function, resolved
+ * once with the plan, instead of the type.
+ */
+static const struct {
+    const char *typname;
+    const char *extname;
+    JsonDecodingTypeFormatter formatter;
+    bool send;
+} builtin_formatters[] = {
+    {"hstore", "hstore", hstore_to_json, false},
+    {"vector", "vector", vector_to_json, false},
+    {"geometry", "postgis", geometry_to_json, true}
+};
 
 static void reportErrorInvalidParam(DefElem *elem);
 
@@ -68,11 +193,32 @@ static void reportUnknownParam(DefElem *elem);
 static bool hasParameter(DefElem *elem,
                          char *param);
 
+static List *split_list(const char *value);
+
+static void parse_options(JsonDecodingData *data, List *options, bool *receive_rewrites);
+
 static void pg_output_begin(LogicalDecodingContext *ctx,
                             JsonDecodingData *data,
                             ReorderBufferTXN *txn,
                             bool last_write);
 
+static void pg_output_event_begin(LogicalDecodingContext *ctx,
+                                  JsonDecodingData *data,
+                                  ReorderBufferTXN *txn);
+
+static void pg_output_heartbeat(LogicalDecodingContext *ctx,
+                                JsonDecodingData *data,
+                                ReorderBufferTXN *txn);
+
+static void pg_update_progress(LogicalDecodingContext *ctx, bool skipped_xact);
+
+static void pg_output_chunk(LogicalDecodingContext *ctx,
+                            JsonDecodingData *data,
+                            ReorderBufferTXN *txn,
+                            ReorderBufferChange *change);
+
+static int64 buffered_bytes(JsonDecodingData *data);
+
 static bool isSystemColumn(Form_pg_attribute attr);
 
 static bool isColumnDeleted(Form_pg_attribute attr);
@@ -82,6 +228,8 @@ static bool isColumnDeleted(Form_pg_attribute attr);
  */
 
 void _PG_init(void) {
+    stats_init();
+    spool_init();
 }
 
 /*
@@ -94,45 +242,179 @@ void _PG_output_plugin_init(OutputPluginCallbacks *cb) {
     cb->startup_cb = pg_decode_startup;
     cb->begin_cb = pg_decode_begin;
     cb->change_cb = pg_decode_change;
+    cb->truncate_cb = pg_decode_truncate;
     cb->commit_cb = pg_decode_commit;
+    cb->message_cb = pg_decode_message;
     cb->filter_by_origin_cb = pg_decode_filter;
     cb->shutdown_cb = pg_decode_shutdown;
+#if PG_VERSION_NUM >= 140000
+    cb->begin_prepare_cb = pg_decode_begin;
+    cb->prepare_cb = pg_decode_prepare;
+    cb->commit_prepared_cb = pg_decode_commit_prepared;
+    cb->rollback_prepared_cb = pg_decode_rollback_prepared;
+#endif
 }
 
 /*
  *  Callback Implementations
  */
 static void pg_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt, bool is_init) {
-    ListCell *option;
     JsonDecodingData *data;
-    bool has_parser_error;
 
     data = palloc0(sizeof(JsonDecodingData));
     data->context = AllocSetContextCreate(ctx->context, "json decoding conversion context", ALLOCSET_DEFAULT_SIZES);
+    data->last_heartbeat = 0;
+
+    ctx->output_plugin_private = data;
+
+    parse_options(data, ctx->output_plugin_options, &opt->receive_rewrites);
+    stats_attach(data);
+
+    if (data->format == FORMAT_JSON && data->compression == COMPRESSION_NONE) {
+        opt->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+    } else {
+        opt->output_type = OUTPUT_PLUGIN_BINARY_OUTPUT;
+    }
+
+    /*
+     * Prepared transactions are decoded at PREPARE only when asked for; the
+     * slot has to be created with two-phase support as well before 15.
+     */
+#if PG_VERSION_NUM >= 150000
+    ctx->twophase_opt_given = data->two_phase;
+#endif
+#if PG_VERSION_NUM >= 140000
+    ctx->twophase &= data->two_phase;
+#else
+    if (data->two_phase) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("two-phase decoding requires PostgreSQL 14 or later")));
+    }
+#endif
+
+    if (data->compression != COMPRESSION_NONE) {
+        initStringInfo(&data->compress_buffer);
+    }
+
+    if (data->format == FORMAT_ARROW) {
+        data->arrow_context = AllocSetContextCreate(ctx->context, "json decoding arrow batches", ALLOCSET_DEFAULT_SIZES);
+        data->arrow_batches = NIL;
+        data->arrow_buffered_bytes = 0;
+    }
+
+    if (data->format == FORMAT_COPY) {
+        initStringInfo(&data->copy_buffer);
+        data->copy_rows = 0;
+    }
+
+    if (data->coalesce_rows) {
+        coalesce_init(ctx, data);
+    }
+
+    render_fragments(data);
+    relation_cache_init(ctx);
+}
+
+/*
+ * Set every option to its default, then apply the given ones. Shared by the
+ * plugin and the SQL functions, which take the same options.
+ */
+static void parse_options(JsonDecodingData *data, List *options, bool *receive_rewrites) {
+    ListCell *option;
+    bool has_parser_error;
+
+    data->format = FORMAT_JSON;
+    data->compression = COMPRESSION_NONE;
     data->include_xids = true;
     data->include_timestamp = true;
+    data->include_lsn = false;
+    data->include_decode_lag = false;
+    data->include_transaction = false;
+    data->two_phase = false;
     data->skip_empty_xacts = true;
     data->only_local = false;
     data->include_messages = false;
+    data->message_prefixes = NIL;
     data->include_toast_datum = true;
-
-    ctx->output_plugin_private = data;
-
-    opt->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
-    opt->receive_rewrites = false;
-
-    foreach(option, ctx->output_plugin_options)
+    data->compact = false;
+    data->omit_nulls = false;
+    data->key_table = "pg_change_table";
+    data->key_timestamp = "pg_change_tnx_time";
+    data->key_xid = "pg_change_tnx_id";
+    data->key_type = "pg_change_type";
+    data->key_old_primary_key = "old_primary_key";
+    data->arrow_batch_rows = 10000;
+    data->max_chunk_changes = 0;
+    data->max_chunk_bytes = 0;
+    data->heartbeat_interval = 0;
+    data->relation_stats = false;
+    data->log_slow_change = 0;
+    data->coalesce_rows = false;
+    data->coalesce_memory = 65536;
+
+
+    *receive_rewrites = false;
+
+    foreach(option, options)
     {
         DefElem *elem = lfirst(option);
         has_parser_error = false;
         Assert(elem->arg == NULL || IsA(elem->arg, String));
 
-        if (hasParameter(elem, "include-xids") && elem->arg != NULL) {
+        if (hasParameter(elem, "format") && elem->arg != NULL) {
+
+            if (strcmp(strVal(elem->arg), "json") == 0) {
+                data->format = FORMAT_JSON;
+            } else if (strcmp(strVal(elem->arg), "msgpack") == 0) {
+                data->format = FORMAT_MSGPACK;
+            } else if (strcmp(strVal(elem->arg), "avro") == 0) {
+                data->format = FORMAT_AVRO;
+            } else if (strcmp(strVal(elem->arg), "arrow") == 0) {
+                data->format = FORMAT_ARROW;
+            } else if (strcmp(strVal(elem->arg), "copy") == 0) {
+                data->format = FORMAT_COPY;
+            } else {
+                has_parser_error = true;
+            }
+        } else if (hasParameter(elem, "compression") && elem->arg != NULL) {
+
+            if (strcmp(strVal(elem->arg), "none") == 0) {
+                data->compression = COMPRESSION_NONE;
+            } else if (strcmp(strVal(elem->arg), "pglz") == 0) {
+                data->compression = COMPRESSION_PGLZ;
+            } else if (strcmp(strVal(elem->arg), "lz4") == 0) {
+                data->compression = COMPRESSION_LZ4;
+            } else if (strcmp(strVal(elem->arg), "zstd") == 0) {
+                data->compression = COMPRESSION_ZSTD;
+            } else {
+                has_parser_error = true;
+            }
+
+            if (!compression_supported(data->compression)) {
+                ereport(ERROR,
+                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                                errmsg("compression method \"%s\" is not supported by this build",
+                                       strVal(elem->arg))));
+            }
+        } else if (hasParameter(elem, "include-xids") && elem->arg != NULL) {
 
             has_parser_error = !parse_bool(strVal(elem->arg), &data->include_xids);
         } else if (hasParameter(elem, "include-timestamp") && elem->arg != NULL) {
 
             has_parser_error = !parse_bool(strVal(elem->arg), &data->include_timestamp);
+        } else if (hasParameter(elem, "include-lsn") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->include_lsn);
+        } else if (hasParameter(elem, "include-decode-lag") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->include_decode_lag);
+        } else if (hasParameter(elem, "include-transaction") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->include_transaction);
+        } else if (hasParameter(elem, "two-phase") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->two_phase);
         } else if (hasParameter(elem, "skip-empty-xacts") && elem->arg != NULL) {
 
             has_parser_error = !parse_bool(strVal(elem->arg), &data->skip_empty_xacts);
@@ -146,10 +428,67 @@ static void pg_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *
 
         } else if (hasParameter(elem, "include-rewrites") && elem->arg != NULL) {
 
-            has_parser_error = !parse_bool(strVal(elem->arg), &opt->receive_rewrites);
+            has_parser_error = !parse_bool(strVal(elem->arg), receive_rewrites);
+        } else if (hasParameter(elem, "include-messages") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->include_messages);
+        } else if (hasParameter(elem, "message-prefixes") && elem->arg != NULL) {
+
+            data->message_prefixes = split_list(strVal(elem->arg));
         } else if (hasParameter(elem, "include-toast-datum") && elem->arg != NULL) {
 
             has_parser_error = !parse_bool(strVal(elem->arg), &data->include_toast_datum);
+        } else if (hasParameter(elem, "compact") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->compact);
+        } else if (hasParameter(elem, "omit-nulls") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->omit_nulls);
+        } else if (hasParameter(elem, "key-table") && elem->arg != NULL) {
+
+            data->key_table = pstrdup(strVal(elem->arg));
+        } else if (hasParameter(elem, "key-timestamp") && elem->arg != NULL) {
+
+            data->key_timestamp = pstrdup(strVal(elem->arg));
+        } else if (hasParameter(elem, "key-xid") && elem->arg != NULL) {
+
+            data->key_xid = pstrdup(strVal(elem->arg));
+        } else if (hasParameter(elem, "key-type") && elem->arg != NULL) {
+
+            data->key_type = pstrdup(strVal(elem->arg));
+        } else if (hasParameter(elem, "key-old-primary-key") && elem->arg != NULL) {
+
+            data->key_old_primary_key = pstrdup(strVal(elem->arg));
+        } else if (hasParameter(elem, "max-changes-per-chunk") && elem->arg != NULL) {
+
+            has_parser_error = !parse_int(strVal(elem->arg), &data->max_chunk_changes, 0, NULL) ||
+                               data->max_chunk_changes < 0;
+        } else if (hasParameter(elem, "max-bytes-per-chunk") && elem->arg != NULL) {
+
+            has_parser_error = !parse_int(strVal(elem->arg), &data->max_chunk_bytes, 0, NULL) ||
+                               data->max_chunk_bytes < 0;
+        } else if (hasParameter(elem, "heartbeat-interval-ms") && elem->arg != NULL) {
+
+            has_parser_error = !parse_int(strVal(elem->arg), &data->heartbeat_interval, 0, NULL) ||
+                               data->heartbeat_interval < 0;
+        } else if (hasParameter(elem, "relation-stats") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->relation_stats);
+        } else if (hasParameter(elem, "log-slow-change-ms") && elem->arg != NULL) {
+
+            has_parser_error = !parse_int(strVal(elem->arg), &data->log_slow_change, 0, NULL) ||
+                               data->log_slow_change < 0;
+        } else if (hasParameter(elem, "coalesce-rows") && elem->arg != NULL) {
+
+            has_parser_error = !parse_bool(strVal(elem->arg), &data->coalesce_rows);
+        } else if (hasParameter(elem, "coalesce-memory-kb") && elem->arg != NULL) {
+
+            has_parser_error = !parse_int(strVal(elem->arg), &data->coalesce_memory, 0, NULL) ||
+                               data->coalesce_memory < 0;
+        } else if (hasParameter(elem, "arrow-batch-rows") && elem->arg != NULL) {
+
+            has_parser_error = !parse_int(strVal(elem->arg), &data->arrow_batch_rows, 0, NULL) ||
+                               data->arrow_batch_rows < 0;
         } else {
             reportUnknownParam(elem);
         }
@@ -164,6 +503,11 @@ static void pg_decode_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
     JsonDecodingData *data = ctx->output_plugin_private;
 
     data->xact_wrote_changes = false;
+    data->xact_changes = 0;
+    data->coalesce_overflow = false;
+    data->chunk_index = 0;
+    data->chunk_changes = 0;
+    data->chunk_bytes = 0;
 
     if (data->skip_empty_xacts)
         return;
@@ -177,237 +521,1582 @@ static void pg_decode_change(LogicalDecodingContext *ctx,
                              Relation relation,
                              ReorderBufferChange *change) {
     JsonDecodingData *data;
-    Form_pg_class class_form;
+    JsonDecodingRelation *relinfo;
     TupleDesc tupdesc;
     MemoryContext old;
 
     data = ctx->output_plugin_private;
 
-    /* output BEGIN if we haven't yet */
-    if (data->skip_empty_xacts && !data->xact_wrote_changes) {
-        pg_output_begin(ctx, data, txn, false);
+    if (data->coalesce_rows) {
+        /* buffered rows must be written with the plan they were decoded with */
+        coalesce_check_plans(ctx, data, txn);
     }
-    data->xact_wrote_changes = true;
 
-    class_form = RelationGetForm(relation);
+    relinfo = get_relation_plan(data, relation);
     tupdesc = RelationGetDescr(relation);
 
     /* Avoid leaking memory by using and resetting our own context */
     old = MemoryContextSwitchTo(data->context);
 
-    OutputPluginPrepareWrite(ctx, true);
+    if (data->coalesce_rows) {
+        coalesce_append_change(ctx, data, relinfo, tupdesc, txn, change);
+    } else {
+        pg_output_change(ctx, data, relinfo, tupdesc, txn, change);
+    }
 
-    appendStringInfoString(ctx->out, "{ \"pg_change_table\": \"");
-    appendStringInfoString(ctx->out,
-                           quote_qualified_identifier(
-                                   get_namespace_name(
-                                           get_rel_namespace(RelationGetRelid(relation))),
-                                   class_form->relrewrite ? get_rel_name(class_form->relrewrite) :
-                                   NameStr(class_form->relname)));
+    MemoryContextSwitchTo(old);
+    MemoryContextReset(data->context);
+}
 
-    appendStringInfoString(ctx->out, "\", ");
+static void pg_decode_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr commit_lsn) {
+    JsonDecodingData *data = ctx->output_plugin_private;
 
-    if (data->include_timestamp) {
-        appendStringInfo(ctx->out, "\"pg_change_tnx_time\": \"%s\", ", timestamptz_to_str(txn->commit_time));
+    if (data->coalesce_rows) {
+        coalesce_flush(ctx, data, txn);
     }
 
-    if (data->include_xids) {
-        appendStringInfo(ctx->out, "\"pg_change_tnx_id\": %u, ", txn->xid);
+    if (data->format == FORMAT_ARROW) {
+        arrow_flush(ctx, data);
+    } else if (data->format == FORMAT_COPY) {
+        copy_flush(ctx, data);
     }
 
-    appendStringInfoString(ctx->out, " \"pg_change_type\": ");
+    if (data->include_transaction && (!data->skip_empty_xacts || data->xact_wrote_changes)) {
+        JsonDecodingEvent event;
 
-    switch (change->action) {
-        case REORDER_BUFFER_CHANGE_INSERT:
-            appendStringInfoString(ctx->out, "\"INSERT\", ");
-            if (change->data.tp.newtuple != NULL) {
-                tuple_to_json_fields(ctx->out,
-                                     tupdesc,
-                                     &change->data.tp.newtuple->tuple,
-                                     false,
-                                     data->include_toast_datum);
-            }
-            break;
-        case REORDER_BUFFER_CHANGE_UPDATE:
-            appendStringInfoString(ctx->out, "\"UPDATE\", ");
+        pg_output_prepare(ctx, true);
 
-            if (change->data.tp.oldtuple != NULL) {
-                appendStringInfoString(ctx->out, " \"old_primary_key\": { ");
-                tuple_to_json_fields(ctx->out, tupdesc,
-                                     &change->data.tp.oldtuple->tuple,
-                                     true,
-                                     data->include_toast_datum);
-                appendStringInfoString(ctx->out, " }, ");
-            }
+        event_start(&event, data, ctx->out, "COMMIT");
+        event_add_uint(&event, data->key_xid, txn->xid);
+        if (data->include_timestamp) {
+            event_add_timestamp(&event, data->key_timestamp, TXN_COMMIT_TIME(txn));
+        }
+        event_add_lsn(&event, KEY_COMMIT_LSN, commit_lsn);
+        event_add_lsn(&event, KEY_END_LSN, txn->end_lsn);
+        event_add_uint(&event, KEY_CHANGE_COUNT, data->xact_changes);
+        if (data->include_decode_lag) {
+            event_add_uint(&event, KEY_DECODE_LAG, decode_lag_ms(txn));
+        }
+        event_end(&event);
+
+        pg_output_write(ctx, true);
+    } else if (!data->xact_wrote_changes) {
+        /*
+         * Nothing was written for the transaction, let the slot advance past
+         * it anyway so WAL isn't retained for changes nobody will receive.
+         */
+        pg_update_progress(ctx, true);
+        pg_output_heartbeat(ctx, data, txn);
+    }
 
-            if (change->data.tp.newtuple != NULL) {
-                tuple_to_json_fields(ctx->out,
-                                     tupdesc,
-                                     &change->data.tp.newtuple->tuple,
-                                     false,
-                                     data->include_toast_datum);
-            }
+    data->counters.transactions++;
+    if (data->track_stats) {
+        data->counters.decode_lag = decode_lag_ms(txn);
+    }
+    stats_publish(data);
+}
 
-            break;
-        case REORDER_BUFFER_CHANGE_DELETE:
-            appendStringInfoString(ctx->out, "\"DELETE\", ");
+#if PG_VERSION_NUM >= 140000
 
-            if (change->data.tp.oldtuple != NULL) {
-                tuple_to_json_fields(ctx->out,
-                                     tupdesc,
-                                     &change->data.tp.oldtuple->tuple,
-                                     true,
-                                     data->include_toast_datum);
-            }
+/*
+ * With two-phase on, the changes of a prepared transaction are written when
+ * it is prepared and followed by a PREPARE event. Its outcome comes later
+ * as COMMIT PREPARED or ROLLBACK PREPARED. These three events are always
+ * written, consumers must not apply the changes before COMMIT PREPARED.
+ */
+static void pg_decode_prepare(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr prepare_lsn) {
+    JsonDecodingData *data = ctx->output_plugin_private;
+    JsonDecodingEvent event;
 
-            break;
-        default:
-            Assert(false);
+    if (data->coalesce_rows) {
+        coalesce_flush(ctx, data, txn);
     }
-    appendStringInfoString(ctx->out, " }");
 
-    MemoryContextSwitchTo(old);
-    MemoryContextReset(data->context);
+    if (data->format == FORMAT_ARROW) {
+        arrow_flush(ctx, data);
+    } else if (data->format == FORMAT_COPY) {
+        copy_flush(ctx, data);
+    }
 
-    OutputPluginWrite(ctx, true);
-}
+    pg_output_prepare(ctx, true);
 
-static void pg_decode_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr commit_lsn) {
+    event_start(&event, data, ctx->out, "PREPARE");
+    event_add_uint(&event, data->key_xid, txn->xid);
+    if (data->include_timestamp) {
+        event_add_timestamp(&event, data->key_timestamp, txn->xact_time.prepare_time);
+    }
+    event_add_string(&event, KEY_GID, txn->gid);
+    event_add_lsn(&event, KEY_PREPARE_LSN, prepare_lsn);
+    event_add_lsn(&event, KEY_END_LSN, txn->end_lsn);
+    event_add_uint(&event, KEY_CHANGE_COUNT, data->xact_changes);
+    event_end(&event);
+
+    pg_output_write(ctx, true);
 
+    data->counters.transactions++;
+    if (data->track_stats) {
+        data->counters.decode_lag = decode_lag_ms(txn);
+    }
+    stats_publish(data);
 }
 
-static bool pg_decode_filter(LogicalDecodingContext *ctx, RepOriginId origin_id) {
+static void pg_decode_commit_prepared(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr commit_lsn) {
     JsonDecodingData *data = ctx->output_plugin_private;
+    JsonDecodingEvent event;
+
+    pg_output_prepare(ctx, true);
+
+    event_start(&event, data, ctx->out, "COMMIT PREPARED");
+    event_add_uint(&event, data->key_xid, txn->xid);
+    if (data->include_timestamp) {
+        event_add_timestamp(&event, data->key_timestamp, TXN_COMMIT_TIME(txn));
+    }
+    event_add_string(&event, KEY_GID, txn->gid);
+    event_add_lsn(&event, KEY_COMMIT_LSN, commit_lsn);
+    event_add_lsn(&event, KEY_END_LSN, txn->end_lsn);
+    event_end(&event);
 
-    return data->only_local && origin_id != InvalidRepOriginId;
+    pg_output_write(ctx, true);
 }
 
-static void pg_decode_shutdown(LogicalDecodingContext *ctx) {
+static void pg_decode_rollback_prepared(LogicalDecodingContext *ctx,
+                                        ReorderBufferTXN *txn,
+                                        XLogRecPtr prepare_end_lsn,
+                                        TimestampTz prepare_time) {
     JsonDecodingData *data = ctx->output_plugin_private;
-    MemoryContextDelete(data->context);
+    JsonDecodingEvent event;
+
+    pg_output_prepare(ctx, true);
+
+    event_start(&event, data, ctx->out, "ROLLBACK PREPARED");
+    event_add_uint(&event, data->key_xid, txn->xid);
+    if (data->include_timestamp) {
+        event_add_timestamp(&event, data->key_timestamp, prepare_time);
+    }
+    event_add_string(&event, KEY_GID, txn->gid);
+    event_add_lsn(&event, KEY_END_LSN, txn->end_lsn);
+    event_end(&event);
+
+    pg_output_write(ctx, true);
 }
 
+#endif
+
 /*
- * Helper Implementations.
-*/
+ * One event for the whole statement, rather than a DELETE per row.
+ */
+static void pg_decode_truncate(LogicalDecodingContext *ctx,
+                               ReorderBufferTXN *txn,
+                               int nrelations,
+                               Relation relations[],
+                               ReorderBufferChange *change) {
+    JsonDecodingData *data = ctx->output_plugin_private;
+    JsonDecodingEvent event;
+    const char **tables;
+    int i;
 
-static void pg_output_begin(LogicalDecodingContext *ctx,
-                            JsonDecodingData *data,
-                            ReorderBufferTXN *txn,
-                            bool last_write) {
-    if (data->include_xids) {
-        data->xid = txn->xid;
+    pg_output_event_begin(ctx, data, txn);
+
+    tables = palloc(sizeof(char *) * Max(nrelations, 1));
+    for (i = 0; i < nrelations; i++) {
+        tables[i] = get_relation_plan(data, relations[i])->table_name;
     }
+
+    pg_output_prepare(ctx, true);
+
+    event_start(&event, data, ctx->out, "TRUNCATE");
     if (data->include_timestamp) {
-        data->commit_time = txn->commit_time;
+        event_add_timestamp(&event, data->key_timestamp, TXN_COMMIT_TIME(txn));
+    }
+    if (data->include_xids) {
+        event_add_uint(&event, data->key_xid, txn->xid);
+    }
+    if (data->include_lsn) {
+        event_add_lsn(&event, KEY_LSN, change->lsn);
+        event_add_lsn(&event, KEY_COMMIT_LSN, txn->final_lsn);
+        event_add_uint(&event, KEY_SEQ, data->xact_changes);
     }
+    event_add_strings(&event, KEY_TABLES, tables, nrelations);
+    event_add_bool(&event, KEY_CASCADE, change->data.truncate.cascade);
+    event_add_bool(&event, KEY_RESTART_IDENTITY, change->data.truncate.restart_seqs);
+    event_end(&event);
+
+    pg_output_write(ctx, true);
+
+    data->counters.truncates++;
+    pfree(tables);
 }
 
+static void pg_decode_message(LogicalDecodingContext *ctx,
+                              ReorderBufferTXN *txn,
+                              XLogRecPtr message_lsn,
+                              bool transactional,
+                              const char *prefix,
+                              Size message_size,
+                              const char *message) {
+    JsonDecodingData *data = ctx->output_plugin_private;
+    JsonDecodingEvent event;
+    ListCell *cell;
+    bool wanted;
 
-static void print_literal(StringInfo s, Oid typid, char *outputstr) {
-    const char *valptr;
+    if (!data->include_messages) {
+        data->counters.filtered++;
+        return;
+    }
 
-    switch (typid) {
-        case INT2OID:
-        case INT4OID:
-        case INT8OID:
-        case OIDOID:
-        case FLOAT4OID:
-        case FLOAT8OID:
-        case NUMERICOID:
-            appendStringInfoString(s, outputstr);
+    wanted = data->message_prefixes == NIL;
+    foreach(cell, data->message_prefixes)
+    {
+        if (strcmp(prefix, lfirst(cell)) == 0) {
+            wanted = true;
             break;
+        }
+    }
 
-        case BITOID:
-        case VARBITOID:
-            appendStringInfo(s, "\"%s\"", outputstr);
-            break;
+    if (!wanted) {
+        data->counters.filtered++;
+        return;
+    }
 
-        case BOOLOID:
-            if (strcmp(outputstr, "t") == 0)
-                appendStringInfoString(s, "true");
-            else
-                appendStringInfoString(s, "false");
-            break;
+    if (transactional) {
+        pg_output_event_begin(ctx, data, txn);
+    }
 
-        default:
-            appendStringInfoChar(s, '"');
-            for (valptr = outputstr; *valptr; valptr++) {
-                char ch = *valptr;
+    pg_output_prepare(ctx, true);
 
-                if (SQL_STR_DOUBLE(ch, false))
-                    appendStringInfoChar(s, ch);
-                appendStringInfoChar(s, ch);
-            }
-            appendStringInfoChar(s, '"');
-            break;
+    event_start(&event, data, ctx->out, "MESSAGE");
+    if (data->include_xids && txn != NULL) {
+        event_add_uint(&event, data->key_xid, txn->xid);
     }
+    event_add_bool(&event, KEY_TRANSACTIONAL, transactional);
+    event_add_string(&event, KEY_PREFIX, prefix);
+    event_add_lsn(&event, KEY_LSN, message_lsn);
+    event_add_bytes(&event, KEY_CONTENT, message, message_size);
+    event_end(&event);
+
+    pg_output_write(ctx, true);
+
+    data->counters.messages++;
 }
 
-static void tuple_to_json_fields(StringInfo s,
-                                 TupleDesc tupdesc,
-                                 HeapTuple tuple,
-                                 bool skip_nulls,
-                                 bool include_toast_datum) {
-    int natt;
+static bool pg_decode_filter(LogicalDecodingContext *ctx, RepOriginId origin_id) {
+    JsonDecodingData *data = ctx->output_plugin_private;
 
-    for (natt = 0; natt < tupdesc->natts; natt++) {
-        Form_pg_attribute attr;
-        Oid typid;
-        Oid typoutput;
-        bool typisvarlena;
-        Datum origval;
-        bool isnull;
+    if (data->only_local && origin_id != InvalidRepOriginId) {
+        data->counters.filtered++;
+        return true;
+    }
 
-        attr = TupleDescAttr(tupdesc, natt);
+    return false;
+}
 
-        if (isColumnDeleted(attr) || isSystemColumn(attr)) {
-            continue;
-        }
+static void pg_decode_shutdown(LogicalDecodingContext *ctx) {
+    JsonDecodingData *data = ctx->output_plugin_private;
 
-        typid = attr->atttypid;
+    stats_publish(data);
 
-        /* get Datum from tuple */
-        origval = heap_getattr(tuple, natt + 1, tupdesc, &isnull);
+    if (data->relation_stats) {
+        relation_cache_log_stats();
+    }
 
-        if (isnull && skip_nulls) {
-            continue;
-        }
+    MemoryContextDelete(data->context);
+}
 
-        if (natt > 0) {
-            appendStringInfoChar(s, ',');
-        }
+/*
+ * SQL Functions.
+ *
+ * The JSON of an insert of the row, as the plugin writes it, so tables can
+ * be backfilled in exactly the format consumers receive from the slot. They
+ * take the plugin's options as name/value pairs, like
+ * pg_logical_slot_get_changes. The timestamp is the start of the current
+ * transaction and the xid its xid, if it has one.
+ */
 
-        appendStringInfoString(s, " \"");
-        appendStringInfoString(s, quote_identifier(NameStr(attr->attname)));
-        appendStringInfoString(s, "\"");
+Datum json_decoding_row(PG_FUNCTION_ARGS) {
+    Oid relid = PG_GETARG_OID(0);
+    HeapTupleHeader row = PG_GETARG_HEAPTUPLEHEADER(1);
+    JsonDecodingData *data = sql_decoding_data(PG_GETARG_ARRAYTYPE_P(2));
+    JsonDecodingRelation *relinfo;
+    Relation relation;
+    HeapTupleData tuple;
+    StringInfoData s;
+
+    relation = relation_open(relid, AccessShareLock);
+
+    if (HeapTupleHeaderGetTypeId(row) != RelationGetForm(relation)->reltype) {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                        errmsg("record is not a row of relation \"%s\"", RelationGetRelationName(relation))));
+    }
 
-        /* query output function */
-        getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+    tuple.t_len = HeapTupleHeaderGetDatumLength(row);
+    ItemPointerSetInvalid(&tuple.t_self);
+    tuple.t_tableOid = relid;
+    tuple.t_data = row;
 
-        /* print separator */
-        appendStringInfoChar(s, ':');
-        appendStringInfoChar(s, ' ');
+    relinfo = sql_relation_plan(data, relation);
 
-        /* print data */
-        if (isnull) {
-            appendStringInfoString(s, "null");
-        } else if (typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval) && !include_toast_datum) {
-            appendStringInfoString(s, "unchanged-toast-datum");
-        } else if (!typisvarlena) {
-            print_literal(s, typid, OidOutputFunctionCall(typoutput, origval));
-        } else {
-            Datum val;    /* definitely detoasted Datum */
+    initStringInfo(&s);
+    data->xact_changes = 1;
+    sql_row_to_json(&s, data, relinfo, relation, &tuple);
 
-            val = PointerGetDatum(PG_DETOAST_DATUM(origval));
-            print_literal(s, typid, OidOutputFunctionCall(typoutput, val));
-        }
+    relation_close(relation, AccessShareLock);
 
-    }
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(s.data, s.len));
 }
 
-void reportErrorInvalidParam(DefElem *elem) {
-    ereport(ERROR,
+Datum json_decoding_table(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid relid = PG_GETARG_OID(0);
+    JsonDecodingData *data = sql_decoding_data(PG_GETARG_ARRAYTYPE_P(1));
+    JsonDecodingRelation *relinfo;
+    Tuplestorestate *tupstore;
+    TupleDesc tupdesc;
+    Relation relation;
+    AclResult aclresult;
+    MemoryContext old;
+    StringInfoData s;
+    HeapTuple tuple;
+    Datum value;
+    bool isnull = false;
+#if PG_VERSION_NUM >= 120000
+    TableScanDesc scan;
+    TupleTableSlot *slot;
+#else
+    HeapScanDesc scan;
+#endif
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || (rsinfo->allowedModes & SFRM_Materialize) == 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("set-valued function called in context that cannot accept a set")));
+    }
+
+    /* checked on the OID, so no lock is taken on a table the caller can't read */
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK) {
+        aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(relid));
+    }
+
+    if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("json_decoding_table does not support row-level security on \"%s\"",
+                               get_rel_name(relid))));
+    }
+
+    relation = relation_open(relid, AccessShareLock);
+
+    if (RelationGetForm(relation)->relkind != RELKIND_RELATION) {
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                        errmsg("\"%s\" is not a table", RelationGetRelationName(relation))));
+    }
+
+    old = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+#if PG_VERSION_NUM >= 120000
+    tupdesc = CreateTemplateTupleDesc(1);
+#else
+    tupdesc = CreateTemplateTupleDesc(1, false);
+#endif
+    TupleDescInitEntry(tupdesc, (AttrNumber) 1, "json_decoding_table", TEXTOID, -1, 0);
+
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    MemoryContextSwitchTo(old);
+
+    relinfo = sql_relation_plan(data, relation);
+    initStringInfo(&s);
+
+#if PG_VERSION_NUM >= 120000
+    scan = table_beginscan(relation, GetActiveSnapshot(), 0, NULL);
+    slot = table_slot_create(relation, NULL);
+
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
+        tuple = ExecFetchSlotHeapTuple(slot, false, NULL);
+#else
+    scan = heap_beginscan(relation, GetActiveSnapshot(), 0, NULL);
+
+    while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+#endif
+        resetStringInfo(&s);
+        data->xact_changes++;
+        sql_row_to_json(&s, data, relinfo, relation, tuple);
+
+        value = PointerGetDatum(cstring_to_text_with_len(s.data, s.len));
+        tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+        pfree(DatumGetPointer(value));
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+#if PG_VERSION_NUM >= 120000
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+#else
+    heap_endscan(scan);
+#endif
+
+    relation_close(relation, AccessShareLock);
+
+    return (Datum) 0;
+}
+
+/*
+ * Helper Implementations.
+*/
+
+/*
+ * Options of the SQL functions, as name/value pairs.
+ */
+JsonDecodingData *sql_decoding_data(ArrayType *options) {
+    JsonDecodingData *data;
+    List *elems = NIL;
+    Datum *datums;
+    bool *nulls;
+    bool receive_rewrites;
+    int ndatums;
+    int i;
+
+    deconstruct_array(options, TEXTOID, -1, false, 'i', &datums, &nulls, &ndatums);
+
+    if (ndatums % 2 != 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("array must have even number of elements")));
+    }
+
+    for (i = 0; i < ndatums; i += 2) {
+        char *name;
+
+        if (nulls[i]) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                            errmsg("option name must not be null")));
+        }
+
+        name = TextDatumGetCString(datums[i]);
+        elems = lappend(elems, makeDefElem(name,
+                                           nulls[i + 1] ? NULL : (Node *) makeString(TextDatumGetCString(datums[i + 1])),
+                                           -1));
+    }
+
+    data = palloc0(sizeof(JsonDecodingData));
+    data->context = AllocSetContextCreate(CurrentMemoryContext, "json decoding conversion context", ALLOCSET_DEFAULT_SIZES);
+
+    parse_options(data, elems, &receive_rewrites);
+
+    if (data->format != FORMAT_JSON || data->compression != COMPRESSION_NONE) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("only format=json without compression is supported by the SQL functions")));
+    }
+
+    render_fragments(data);
+
+    return data;
+}
+
+JsonDecodingRelation *sql_relation_plan(JsonDecodingData *data, Relation relation) {
+    JsonDecodingRelation *relinfo = palloc0(sizeof(JsonDecodingRelation));
+
+    relinfo->relid = RelationGetRelid(relation);
+    build_relation_plan(data, relinfo, relation, CurrentMemoryContext);
+
+    return relinfo;
+}
+
+/*
+ * Serialize the row as an insert, in the conversion context.
+ */
+void sql_row_to_json(StringInfo s,
+                     JsonDecodingData *data,
+                     JsonDecodingRelation *relinfo,
+                     Relation relation,
+                     HeapTuple tuple) {
+    ReorderBufferTupleBuf newtuple;
+    ReorderBufferChange change;
+    ReorderBufferTXN txn;
+    MemoryContext old;
+
+    MemSet(&txn, 0, sizeof(txn));
+    txn.xid = GetTopTransactionIdIfAny();
+    TXN_COMMIT_TIME(&txn) = GetCurrentTransactionStartTimestamp();
+
+    MemSet(&newtuple, 0, sizeof(newtuple));
+    newtuple.tuple = *tuple;
+
+    MemSet(&change, 0, sizeof(change));
+    change.action = REORDER_BUFFER_CHANGE_INSERT;
+    change.data.tp.newtuple = &newtuple;
+
+    old = MemoryContextSwitchTo(data->context);
+    change_to_json(s, data, relinfo, RelationGetDescr(relation), &txn, &change);
+    MemoryContextSwitchTo(old);
+    MemoryContextReset(data->context);
+}
+
+static void pg_output_begin(LogicalDecodingContext *ctx,
+                            JsonDecodingData *data,
+                            ReorderBufferTXN *txn,
+                            bool last_write) {
+    if (data->include_xids) {
+        data->xid = txn->xid;
+    }
+    if (data->include_timestamp) {
+        data->commit_time = TXN_COMMIT_TIME(txn);
+    }
+
+    if (data->include_transaction) {
+        JsonDecodingEvent event;
+
+        pg_output_prepare(ctx, last_write);
+
+#if PG_VERSION_NUM >= 140000
+        if (rbtxn_prepared(txn)) {
+            event_start(&event, data, ctx->out, "BEGIN PREPARE");
+            event_add_uint(&event, data->key_xid, txn->xid);
+            if (data->include_timestamp) {
+                event_add_timestamp(&event, data->key_timestamp, TXN_COMMIT_TIME(txn));
+            }
+            event_add_string(&event, KEY_GID, txn->gid);
+            event_add_lsn(&event, KEY_PREPARE_LSN, txn->final_lsn);
+            event_end(&event);
+
+            pg_output_write(ctx, last_write);
+            return;
+        }
+#endif
+
+        event_start(&event, data, ctx->out, "BEGIN");
+        event_add_uint(&event, data->key_xid, txn->xid);
+        if (data->include_timestamp) {
+            event_add_timestamp(&event, data->key_timestamp, TXN_COMMIT_TIME(txn));
+        }
+        event_add_lsn(&event, KEY_COMMIT_LSN, txn->final_lsn);
+        event_end(&event);
+
+        pg_output_write(ctx, last_write);
+    }
+}
+
+/*
+ * Start an event that is part of the transaction: output BEGIN if we haven't
+ * yet and write out the buffered changes, so the event stays in order.
+ */
+static void pg_output_event_begin(LogicalDecodingContext *ctx,
+                                  JsonDecodingData *data,
+                                  ReorderBufferTXN *txn) {
+    if (data->coalesce_rows) {
+        coalesce_flush(ctx, data, txn);
+    }
+
+    if (data->skip_empty_xacts && !data->xact_wrote_changes) {
+        pg_output_begin(ctx, data, txn, false);
+    }
+    data->xact_wrote_changes = true;
+    data->xact_changes++;
+
+    if (data->format == FORMAT_ARROW) {
+        arrow_flush(ctx, data);
+    } else if (data->format == FORMAT_COPY) {
+        copy_flush(ctx, data);
+    }
+}
+
+/*
+ * With heartbeat-interval-ms set, a transaction that wrote nothing emits a
+ * HEARTBEAT event when the last one is older than the interval. Consumers
+ * that only confirm the LSNs they receive can then advance the slot across
+ * long stretches of filtered or empty transactions.
+ */
+static void pg_output_heartbeat(LogicalDecodingContext *ctx,
+                                JsonDecodingData *data,
+                                ReorderBufferTXN *txn) {
+    JsonDecodingEvent event;
+    TimestampTz now;
+
+    if (data->heartbeat_interval == 0) {
+        return;
+    }
+
+    now = GetCurrentTimestamp();
+    if (!TimestampDifferenceExceeds(data->last_heartbeat, now, data->heartbeat_interval)) {
+        return;
+    }
+    data->last_heartbeat = now;
+
+    pg_output_prepare(ctx, true);
+
+    event_start(&event, data, ctx->out, "HEARTBEAT");
+    if (data->include_timestamp) {
+        event_add_timestamp(&event, data->key_timestamp, TXN_COMMIT_TIME(txn));
+    }
+    event_add_lsn(&event, KEY_END_LSN, txn->end_lsn);
+    event_end(&event);
+
+    pg_output_write(ctx, true);
+}
+
+static void pg_update_progress(LogicalDecodingContext *ctx, bool skipped_xact) {
+#if PG_VERSION_NUM >= 150000
+    OutputPluginUpdateProgress(ctx, skipped_xact);
+#else
+    OutputPluginUpdateProgress(ctx);
+#endif
+}
+
+/*
+ * Write a change in the configured format, called in the conversion context.
+ */
+void pg_output_change(LogicalDecodingContext *ctx,
+                      JsonDecodingData *data,
+                      JsonDecodingRelation *relinfo,
+                      TupleDesc tupdesc,
+                      ReorderBufferTXN *txn,
+                      ReorderBufferChange *change) {
+    bool timed = data->relation_stats || data->track_stats || data->log_slow_change > 0;
+    int64 bytes = data->counters.bytes - data->flushed_bytes;
+    instr_time start;
+    instr_time elapsed;
+
+    /* output BEGIN if we haven't yet */
+    if (data->skip_empty_xacts && !data->xact_wrote_changes) {
+        pg_output_begin(ctx, data, txn, false);
+    }
+    data->xact_wrote_changes = true;
+    data->xact_changes++;
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            data->counters.inserts++;
+            break;
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            data->counters.updates++;
+            break;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            data->counters.deletes++;
+            break;
+        default:
+            break;
+    }
+
+    INSTR_TIME_SET_ZERO(start);
+    if (timed) {
+        INSTR_TIME_SET_CURRENT(start);
+    }
+
+    if (data->format == FORMAT_ARROW) {
+        /* buffered, written at commit or when the batch is full */
+        arrow_append_change(ctx, data, relinfo, tupdesc, txn, change);
+    } else if (data->format == FORMAT_COPY) {
+        /* inserts are buffered into COPY runs */
+        copy_append_change(ctx, data, relinfo, tupdesc, change);
+    } else {
+        if (data->format == FORMAT_AVRO && avro_schema_pending(relinfo)) {
+            pg_output_prepare(ctx, false);
+            avro_schema_message(ctx->out, relinfo);
+            pg_output_write(ctx, false);
+        }
+
+        pg_output_prepare(ctx, true);
+
+        if (data->format == FORMAT_MSGPACK) {
+            change_to_msgpack(ctx->out, data, relinfo, tupdesc, txn, change);
+        } else if (data->format == FORMAT_AVRO) {
+            change_to_avro(ctx->out, data, relinfo, tupdesc, txn, change);
+        } else {
+            change_to_json(ctx->out, data, relinfo, tupdesc, txn, change);
+        }
+
+        pg_output_write(ctx, true);
+    }
+
+    if (timed) {
+        INSTR_TIME_SET_CURRENT(elapsed);
+        INSTR_TIME_SUBTRACT(elapsed, start);
+        /* arrow batches and COPY runs were charged to their own relation */
+        bytes = data->counters.bytes - data->flushed_bytes - bytes;
+
+        if (data->relation_stats) {
+            INSTR_TIME_ADD(relinfo->stats_time, elapsed);
+            relinfo->stats_rows++;
+            relinfo->stats_bytes += bytes;
+        }
+
+        if (data->track_stats) {
+            stats_histogram_add(data->counters.change_time_histogram, INSTR_TIME_GET_MICROSEC(elapsed));
+        }
+
+        if (data->log_slow_change > 0 && INSTR_TIME_GET_MILLISEC(elapsed) >= data->log_slow_change) {
+            ereport(LOG,
+                    (errmsg("json_decoding slow change: %s on %s took %.3f ms",
+                            change_type_name(change->action),
+                            relinfo->table_name,
+                            INSTR_TIME_GET_MILLISEC(elapsed)),
+                            errdetail("xid %u, LSN %X/%X, " INT64_FORMAT " bytes",
+                                      txn->xid,
+                                      (uint32) (change->lsn >> 32),
+                                      (uint32) change->lsn,
+                                      bytes)));
+        }
+    }
+
+    /* rows buffered by format=arrow and format=copy count before they are written */
+    data->chunk_changes++;
+    if ((data->max_chunk_changes > 0 && data->chunk_changes >= data->max_chunk_changes) ||
+        (data->max_chunk_bytes > 0 &&
+         data->chunk_bytes + buffered_bytes(data) >= data->max_chunk_bytes)) {
+        pg_output_chunk(ctx, data, txn, change);
+    }
+}
+
+/*
+ * Close the current chunk of a large transaction. Everything the chunk holds
+ * has been written once the CHUNK event arrives, so consumers can process
+ * and checkpoint it without buffering the whole transaction.
+ */
+static void pg_output_chunk(LogicalDecodingContext *ctx,
+                            JsonDecodingData *data,
+                            ReorderBufferTXN *txn,
+                            ReorderBufferChange *change) {
+    JsonDecodingEvent event;
+
+    if (data->format == FORMAT_ARROW) {
+        arrow_flush(ctx, data);
+    } else if (data->format == FORMAT_COPY) {
+        copy_flush(ctx, data);
+    }
+
+    pg_output_prepare(ctx, true);
+
+    event_start(&event, data, ctx->out, "CHUNK");
+    event_add_uint(&event, data->key_xid, txn->xid);
+    event_add_uint(&event, KEY_CHUNK, data->chunk_index);
+    event_add_lsn(&event, KEY_LSN, change->lsn);
+    event_add_uint(&event, KEY_CHANGE_COUNT, data->chunk_changes);
+    event_end(&event);
+
+    pg_output_write(ctx, true);
+
+    data->chunk_index++;
+    data->chunk_changes = 0;
+    data->chunk_bytes = 0;
+}
+
+/*
+ * Bytes of rows buffered by the batched formats and not written yet.
+ */
+static int64 buffered_bytes(JsonDecodingData *data) {
+    switch (data->format) {
+        case FORMAT_ARROW:
+            return data->arrow_buffered_bytes;
+        case FORMAT_COPY:
+            return data->copy_buffer.len;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Every message goes through these two, so whole messages can be
+ * post-processed before they are handed to the output plugin API.
+ */
+void pg_output_prepare(LogicalDecodingContext *ctx, bool last_write) {
+    JsonDecodingData *data = ctx->output_plugin_private;
+
+    OutputPluginPrepareWrite(ctx, last_write);
+    data->write_start = ctx->out->len;
+}
+
+void pg_output_write(LogicalDecodingContext *ctx, bool last_write) {
+    JsonDecodingData *data = ctx->output_plugin_private;
+    int64 size;
+
+    if (data->compression != COMPRESSION_NONE) {
+        compress_output(data, ctx->out, data->write_start);
+    }
+
+    size = ctx->out->len - data->write_start;
+    data->chunk_bytes += size;
+    data->counters.bytes += size;
+    data->counters.max_message_bytes = Max(data->counters.max_message_bytes, size);
+    if (data->track_stats) {
+        stats_histogram_add(data->counters.message_size_histogram, size);
+    }
+
+    OutputPluginWrite(ctx, last_write);
+}
+
+const char *change_type_name(ReorderBufferChangeType action) {
+    switch (action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            return "INSERT";
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            return "UPDATE";
+        case REORDER_BUFFER_CHANGE_DELETE:
+            return "DELETE";
+        default:
+            Assert(false);
+    }
+    return "UNKNOWN";
+}
+
+/*
+ * Microseconds since the Unix epoch, for the binary formats. Infinite
+ * timestamps, and the few finite ones that overflow after the epoch shift,
+ * saturate.
+ */
+int64 timestamp_to_unix_micros(TimestampTz value) {
+    const int64 epoch_shift = (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
+
+    if (TIMESTAMP_IS_NOBEGIN(value)) {
+        return PG_INT64_MIN;
+    }
+    if (TIMESTAMP_IS_NOEND(value) || value > PG_INT64_MAX - epoch_shift) {
+        return PG_INT64_MAX;
+    }
+    return value + epoch_shift;
+}
+
+/*
+ * Time from the commit of the transaction, or its PREPARE with two-phase, to
+ * now. Commit timestamps come from the same clock, but can be a little ahead
+ * of it when the clock was stepped back.
+ */
+uint64 decode_lag_ms(ReorderBufferTXN *txn) {
+    TimestampTz now = GetCurrentTimestamp();
+
+    return now > TXN_COMMIT_TIME(txn) ? (uint64) (now - TXN_COMMIT_TIME(txn)) / 1000 : 0;
+}
+
+static void change_to_json(StringInfo s,
+                           JsonDecodingData *data,
+                           JsonDecodingRelation *relinfo,
+                           TupleDesc tupdesc,
+                           ReorderBufferTXN *txn,
+                           ReorderBufferChange *change) {
+    appendStringInfoString(s, data->fragments.table);
+    appendStringInfoString(s, relinfo->table_json);
+
+    if (data->include_timestamp) {
+        appendStringInfoString(s, data->fragments.timestamp);
+        appendStringInfoChar(s, '"');
+        appendStringInfoString(s, timestamptz_to_str(TXN_COMMIT_TIME(txn)));
+        appendStringInfoChar(s, '"');
+    }
+
+    if (data->include_xids) {
+        appendStringInfoString(s, data->fragments.xid);
+        appendStringInfo(s, "%u", txn->xid);
+    }
+
+    if (data->include_lsn) {
+        appendStringInfoString(s, data->fragments.lsn);
+        appendStringInfo(s, "\"%X/%X\"", (uint32) (change->lsn >> 32), (uint32) change->lsn);
+        appendStringInfoString(s, data->fragments.commit_lsn);
+        appendStringInfo(s, "\"%X/%X\"", (uint32) (txn->final_lsn >> 32), (uint32) txn->final_lsn);
+        appendStringInfoString(s, data->fragments.seq);
+        appendStringInfo(s, INT64_FORMAT, data->xact_changes);
+    }
+
+    if (data->include_decode_lag) {
+        appendStringInfoString(s, data->fragments.decode_lag);
+        appendStringInfo(s, UINT64_FORMAT, decode_lag_ms(txn));
+    }
+
+    appendStringInfoString(s, data->fragments.type);
+
+    appendStringInfoChar(s, '"');
+    appendStringInfoString(s, change_type_name(change->action));
+    appendStringInfoChar(s, '"');
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            if (change->data.tp.newtuple != NULL) {
+                tuple_to_json_fields(s,
+                                     data,
+                                     relinfo,
+                                     tupdesc,
+                                     &change->data.tp.newtuple->tuple,
+                                     data->omit_nulls,
+                                     false);
+            }
+            break;
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            if (change->data.tp.oldtuple != NULL) {
+                appendStringInfoString(s, data->fragments.old_key);
+                tuple_to_json_fields(s,
+                                     data,
+                                     relinfo,
+                                     tupdesc,
+                                     &change->data.tp.oldtuple->tuple,
+                                     true,
+                                     true);
+                appendStringInfoString(s, data->fragments.close);
+            }
+
+            if (change->data.tp.newtuple != NULL) {
+                tuple_to_json_fields(s,
+                                     data,
+                                     relinfo,
+                                     tupdesc,
+                                     &change->data.tp.newtuple->tuple,
+                                     data->omit_nulls,
+                                     false);
+            }
+
+            break;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            if (change->data.tp.oldtuple != NULL) {
+                tuple_to_json_fields(s,
+                                     data,
+                                     relinfo,
+                                     tupdesc,
+                                     &change->data.tp.oldtuple->tuple,
+                                     true,
+                                     false);
+            }
+
+            break;
+        default:
+            Assert(false);
+    }
+    appendStringInfoString(s, data->fragments.close);
+}
+
+static void render_fragments(JsonDecodingData *data) {
+    JsonDecodingFragments *fragments = &data->fragments;
+
+    fragments->separator = data->compact ? "," : ", ";
+    fragments->close = data->compact ? "}" : " }";
+
+    fragments->table = render_key(data, data->compact ? "{" : "{ ", data->key_table, "");
+    fragments->timestamp = render_key(data, fragments->separator, data->key_timestamp, "");
+    fragments->xid = render_key(data, fragments->separator, data->key_xid, "");
+    fragments->lsn = render_key(data, fragments->separator, KEY_LSN, "");
+    fragments->commit_lsn = render_key(data, fragments->separator, KEY_COMMIT_LSN, "");
+    fragments->seq = render_key(data, fragments->separator, KEY_SEQ, "");
+    fragments->decode_lag = render_key(data, fragments->separator, KEY_DECODE_LAG, "");
+    fragments->type = render_key(data, fragments->separator, data->key_type, "");
+    fragments->old_key = render_key(data, fragments->separator, data->key_old_primary_key, data->compact ? "{" : "{ ");
+}
+
+/*
+ * prefix + "key" + colon + suffix, with the key escaped as a JSON string.
+ */
+static char *render_key(JsonDecodingData *data, const char *prefix, const char *key, const char *suffix) {
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    appendStringInfoString(&buf, prefix);
+    escape_json(&buf, key);
+    appendStringInfoString(&buf, data->compact ? ":" : ": ");
+    appendStringInfoString(&buf, suffix);
+
+    return buf.data;
+}
+
+static void print_literal(StringInfo s, Oid typid, char *outputstr) {
+    switch (typid) {
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case OIDOID:
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+            appendStringInfoString(s, outputstr);
+            break;
+
+        case BITOID:
+        case VARBITOID:
+            appendStringInfo(s, "\"%s\"", outputstr);
+            break;
+
+        case BOOLOID:
+            if (strcmp(outputstr, "t") == 0)
+                appendStringInfoString(s, "true");
+            else
+                appendStringInfoString(s, "false");
+            break;
+
+        default:
+            /* control characters too, so a message never spans lines */
+            escape_json(s, outputstr);
+            break;
+    }
+}
+
+static void tuple_to_json_fields(StringInfo s,
+                                 JsonDecodingData *data,
+                                 JsonDecodingRelation *relinfo,
+                                 TupleDesc tupdesc,
+                                 HeapTuple tuple,
+                                 bool skip_nulls,
+                                 bool first) {
+    instr_time start;
+    instr_time end;
+    instr_time column_start;
+    instr_time column_end;
+    int column_len = 0;
+    int natt;
+
+    INSTR_TIME_SET_ZERO(start);
+    INSTR_TIME_SET_ZERO(column_start);
+    if (data->track_stats) {
+        INSTR_TIME_SET_CURRENT(start);
+    }
+
+    /* one pass over the tuple; nulls come straight from its null bitmap */
+    heap_deform_tuple(tuple, tupdesc, relinfo->values, relinfo->nulls);
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column;
+        Datum origval;
+        bool isnull;
+
+        column = &relinfo->columns[natt];
+        isnull = relinfo->nulls[natt];
+
+        if (column->skip || (isnull && skip_nulls)) {
+            continue;
+        }
+
+        origval = relinfo->values[natt];
+
+        if (data->relation_stats) {
+            INSTR_TIME_SET_CURRENT(column_start);
+            column_len = s->len;
+        }
+
+        if (!first) {
+            appendStringInfoString(s, data->fragments.separator);
+        }
+        first = false;
+
+        appendStringInfoString(s, column->key);
+
+        /* print data */
+        if (isnull) {
+            appendStringInfoString(s, "null");
+        } else if (column->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval) && !data->include_toast_datum) {
+            appendStringInfoString(s, "unchanged-toast-datum");
+        } else if (!column->typisvarlena) {
+            if (column->formatter != NULL) {
+                column->formatter(s, column->formatter_oid, origval);
+            } else {
+                print_literal(s, column->typid, OidOutputFunctionCall(column->typoutput, origval));
+            }
+        } else {
+            Datum val;    /* definitely detoasted Datum */
+
+            val = PointerGetDatum(PG_DETOAST_DATUM(origval));
+
+            if (val != origval) {
+                data->counters.detoasted++;
+                data->counters.detoasted_bytes += VARSIZE(DatumGetPointer(val));
+            }
+
+            if (column->formatter != NULL) {
+                column->formatter(s, column->formatter_oid, val);
+            } else {
+                print_literal(s, column->typid, OidOutputFunctionCall(column->typoutput, val));
+            }
+        }
+
+        if (data->relation_stats) {
+            JsonDecodingColumnStats *stats = &relinfo->column_stats[natt];
+
+            INSTR_TIME_SET_CURRENT(column_end);
+            INSTR_TIME_ACCUM_DIFF(stats->time, column_end, column_start);
+            stats->values++;
+            stats->bytes += s->len - column_len;
+        }
+    }
+
+    if (data->track_stats) {
+        INSTR_TIME_SET_CURRENT(end);
+        INSTR_TIME_ACCUM_DIFF(data->serialize_time, end, start);
+    }
+}
+
+/*
+ * Relation plan cache.
+ *
+ * The cache lives in a child of the decoding context, so it goes away with
+ * the decoding session; invalidation callbacks can't be unregistered and
+ * therefore check for a NULL cache.
+ */
+static void relation_cache_init(LogicalDecodingContext *ctx) {
+    HASHCTL ctl;
+    MemoryContextCallback *reset_callback;
+
+    relation_cache_context = AllocSetContextCreate(ctx->context, "json decoding relation cache", ALLOCSET_DEFAULT_SIZES);
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(JsonDecodingRelation);
+    ctl.hcxt = relation_cache_context;
+    relation_cache = hash_create("json decoding relation cache", 128, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    reset_callback = MemoryContextAllocZero(relation_cache_context, sizeof(MemoryContextCallback));
+    reset_callback->func = relation_cache_reset_cb;
+    MemoryContextRegisterResetCallback(relation_cache_context, reset_callback);
+
+    if (!relation_cache_callbacks_registered) {
+        CacheRegisterRelcacheCallback(relation_cache_invalidate_cb, (Datum) 0);
+        CacheRegisterSyscacheCallback(TYPEOID, type_cache_invalidate_cb, (Datum) 0);
+        relation_cache_callbacks_registered = true;
+    }
+}
+
+static void relation_cache_reset_cb(void *arg) {
+    relation_cache_context = NULL;
+    relation_cache = NULL;
+}
+
+/*
+ * relation-stats: one LOG line per relation decoded in the session, with the
+ * JSON columns in the detail. A walsender's cache is its own, so the counts
+ * are logged rather than exposed to other sessions.
+ */
+static void relation_cache_log_stats(void) {
+    JsonDecodingRelation *relinfo;
+    HASH_SEQ_STATUS status;
+    StringInfoData detail;
+    int natt;
+
+    if (relation_cache == NULL) {
+        return;
+    }
+
+    initStringInfo(&detail);
+
+    hash_seq_init(&status, relation_cache);
+    while ((relinfo = hash_seq_search(&status)) != NULL) {
+        if (relinfo->stats_rows == 0) {
+            continue;
+        }
+
+        resetStringInfo(&detail);
+        for (natt = 0; natt < Min(relinfo->natts, relinfo->stats_ncolumns); natt++) {
+            JsonDecodingColumnStats *stats = &relinfo->column_stats[natt];
+
+            if (relinfo->columns[natt].skip || stats->values == 0) {
+                continue;
+            }
+
+            appendStringInfo(&detail, "%scolumn %s: " INT64_FORMAT " values, " INT64_FORMAT " bytes, %.3f ms",
+                             detail.len > 0 ? "; " : "",
+                             quote_identifier(relinfo->columns[natt].name),
+                             stats->values,
+                             stats->bytes,
+                             INSTR_TIME_GET_MILLISEC(stats->time));
+        }
+
+        ereport(LOG,
+                (errmsg("json_decoding relation %s: " INT64_FORMAT " rows, " INT64_FORMAT " bytes, %.3f ms",
+                        relinfo->table_name,
+                        relinfo->stats_rows,
+                        relinfo->stats_bytes,
+                        INSTR_TIME_GET_MILLISEC(relinfo->stats_time)),
+                        detail.len > 0 ? errdetail("%s", detail.data) : 0));
+    }
+
+    pfree(detail.data);
+}
+
+static void relation_cache_invalidate_cb(Datum arg, Oid relid) {
+    JsonDecodingRelation *relinfo;
+    HASH_SEQ_STATUS status;
+
+    if (relation_cache == NULL) {
+        return;
+    }
+
+    if (OidIsValid(relid)) {
+        relinfo = hash_search(relation_cache, &relid, HASH_FIND, NULL);
+        if (relinfo != NULL) {
+            relinfo->valid = false;
+        }
+        return;
+    }
+
+    hash_seq_init(&status, relation_cache);
+    while ((relinfo = hash_seq_search(&status)) != NULL) {
+        relinfo->valid = false;
+    }
+}
+
+static void type_cache_invalidate_cb(Datum arg, int cacheid, uint32 hashvalue) {
+    relation_cache_invalidate_cb(arg, InvalidOid);
+}
+
+static JsonDecodingRelation *get_relation_plan(JsonDecodingData *data, Relation relation) {
+    JsonDecodingRelation *relinfo;
+    Oid relid = RelationGetRelid(relation);
+    bool found;
+
+    relinfo = hash_search(relation_cache, &relid, HASH_ENTER, &found);
+
+    if (!found) {
+        relinfo->valid = false;
+        relinfo->context = NULL;
+        relinfo->generation = 0;
+        relinfo->avro_schema_sent = false;
+        relinfo->stats_rows = 0;
+        relinfo->stats_bytes = 0;
+        INSTR_TIME_SET_ZERO(relinfo->stats_time);
+        relinfo->stats_ncolumns = 0;
+        relinfo->column_stats = NULL;
+    }
+
+    if (!relinfo->valid) {
+        build_relation_plan(data, relinfo, relation, relation_cache_context);
+    }
+
+    return relinfo;
+}
+
+static void build_relation_plan(JsonDecodingData *data,
+                                JsonDecodingRelation *relinfo,
+                                Relation relation,
+                                MemoryContext parent) {
+    Form_pg_class class_form = RelationGetForm(relation);
+    TupleDesc tupdesc = RelationGetDescr(relation);
+    StringInfoData table_json;
+    MemoryContext old;
+    Bitmapset *identity_key = NULL;
+    bool typisvarlena;
+    bool formatter_send;
+    char *nspname;
+    char *relname;
+    int natt;
+
+    if (relinfo->context != NULL) {
+        MemoryContextDelete(relinfo->context);
+    }
+
+    relinfo->context = AllocSetContextCreate(parent,
+                                             "json decoding relation",
+                                             ALLOCSET_SMALL_SIZES);
+    old = MemoryContextSwitchTo(relinfo->context);
+
+    nspname = get_namespace_name(RelationGetNamespace(relation));
+    relname = class_form->relrewrite ? get_rel_name(class_form->relrewrite) : NameStr(class_form->relname);
+
+    relinfo->table_name = pstrdup(quote_qualified_identifier(nspname, relname));
+
+    initStringInfo(&table_json);
+    escape_json(&table_json, relinfo->table_name);
+    relinfo->table_json = table_json.data;
+
+    relinfo->natts = tupdesc->natts;
+    relinfo->columns = palloc0(sizeof(JsonDecodingColumn) * Max(tupdesc->natts, 1));
+    relinfo->values = palloc(sizeof(Datum) * Max(tupdesc->natts, 1));
+    relinfo->nulls = palloc(sizeof(bool) * Max(tupdesc->natts, 1));
+    if (data->format == FORMAT_MSGPACK) {
+        relinfo->old_values = palloc(sizeof(Datum) * Max(tupdesc->natts, 1));
+        relinfo->old_nulls = palloc(sizeof(bool) * Max(tupdesc->natts, 1));
+    }
+
+    if ((data->format == FORMAT_COPY || data->coalesce_rows) && class_form->relreplident != REPLICA_IDENTITY_FULL) {
+        identity_key = RelationGetIndexAttrBitmap(relation, INDEX_ATTR_BITMAP_IDENTITY_KEY);
+    }
+    relinfo->keyed = identity_key != NULL;
+
+    for (natt = 0; natt < tupdesc->natts; natt++) {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, natt);
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+
+        if (isColumnDeleted(attr) || isSystemColumn(attr)) {
+            column->skip = true;
+            continue;
+        }
+
+        column->typid = attr->atttypid;
+        getTypeOutputInfo(column->typid, &column->typoutput, &column->typisvarlena);
+        column->kind = get_column_kind(column->typid);
+        column->name = pstrdup(NameStr(attr->attname));
+        column->key = render_key(data, "", column->name, "");
+#if PG_VERSION_NUM >= 120000
+        column->generated = attr->attgenerated != '\0';
+#endif
+
+        if (data->format == FORMAT_COPY) {
+            getTypeBinaryOutputInfo(column->typid, &column->typsend, &typisvarlena);
+        }
+
+        if (data->format == FORMAT_COPY || data->coalesce_rows) {
+            column->identity = class_form->relreplident == REPLICA_IDENTITY_FULL ||
+                               bms_is_member(attr->attnum - FirstLowInvalidHeapAttributeNumber, identity_key);
+        }
+
+        column->formatter_oid = column->typid;
+        switch (column->typid) {
+            case FLOAT4OID:
+                column->formatter = float4_to_json;
+                break;
+            case FLOAT8OID:
+                column->formatter = float8_to_json;
+                break;
+            default:
+                column->formatter = lookup_type_formatter(column->typid, &formatter_send);
+                if (formatter_send) {
+                    getTypeBinaryOutputInfo(column->typid, &column->typsend, &typisvarlena);
+                    column->formatter_oid = column->typsend;
+                }
+                break;
+        }
+    }
+
+    if (data->format == FORMAT_AVRO) {
+        avro_build_schema(data, relinfo, nspname, relname);
+    }
+
+    MemoryContextSwitchTo(old);
+
+    /* attribute numbers are never reused, so counts carry over as columns are added */
+    if (data->relation_stats && relinfo->stats_ncolumns < relinfo->natts) {
+        JsonDecodingColumnStats *column_stats = MemoryContextAllocZero(parent,
+                                                                       sizeof(JsonDecodingColumnStats) *
+                                                                       relinfo->natts);
+
+        if (relinfo->column_stats != NULL) {
+            memcpy(column_stats, relinfo->column_stats, sizeof(JsonDecodingColumnStats) * relinfo->stats_ncolumns);
+            pfree(relinfo->column_stats);
+        }
+        relinfo->column_stats = column_stats;
+        relinfo->stats_ncolumns = relinfo->natts;
+    }
+
+    relinfo->generation++;
+    relinfo->valid = true;
+}
+
+static JsonDecodingColumnKind get_column_kind(Oid typid) {
+    switch (typid) {
+        case BOOLOID:
+            return COLUMN_KIND_BOOL;
+        case INT2OID:
+            return COLUMN_KIND_INT2;
+        case INT4OID:
+            return COLUMN_KIND_INT4;
+        case INT8OID:
+            return COLUMN_KIND_INT8;
+        case OIDOID:
+            return COLUMN_KIND_OID;
+        case FLOAT4OID:
+            return COLUMN_KIND_FLOAT4;
+        case FLOAT8OID:
+            return COLUMN_KIND_FLOAT8;
+        case TIMESTAMPOID:
+            return COLUMN_KIND_TIMESTAMP;
+        case TIMESTAMPTZOID:
+            return COLUMN_KIND_TIMESTAMPTZ;
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+        case JSONOID:
+            return COLUMN_KIND_TEXT;
+        case BYTEAOID:
+            return COLUMN_KIND_BYTEA;
+        default:
+            return COLUMN_KIND_OTHER;
+    }
+}
+
+/*
+ * Find a registered formatter for the type, by plain or schema-qualified
+ * name. Later registrations take precedence over earlier ones, and all of
+ * them over the built-ins, which only apply to the type of the extension
+ * they were written for. *send is set for a built-in taking the send
+ * function.
+ */
+static JsonDecodingTypeFormatter lookup_type_formatter(Oid typid, bool *send) {
+    JsonDecodingTypeFormatterRegistry *registry = json_decoding_type_formatter_registry();
+    JsonDecodingTypeFormatter formatter = NULL;
+    HeapTuple type_tuple;
+    Form_pg_type type_form;
+    char *qualified_name;
+    Oid extension;
+    int i;
+
+    *send = false;
+
+    if (typid < FirstNormalObjectId) {
+        return NULL;
+    }
+
+    type_tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+    if (!HeapTupleIsValid(type_tuple)) {
+        return NULL;
+    }
+
+    type_form = (Form_pg_type) GETSTRUCT(type_tuple);
+    qualified_name = psprintf("%s.%s", get_namespace_name(type_form->typnamespace), NameStr(type_form->typname));
+
+    for (i = registry->count - 1; i >= 0; i--) {
+        const char *typname = registry->entries[i].typname;
+
+        if (strcmp(typname, NameStr(type_form->typname)) == 0 || strcmp(typname, qualified_name) == 0) {
+            formatter = registry->entries[i].formatter;
+            break;
+        }
+    }
+
+    if (formatter == NULL && (extension = getExtensionOfObject(TypeRelationId, typid)) != InvalidOid) {
+        char *extname = get_extension_name(extension);
+
+        for (i = 0; i < lengthof(builtin_formatters); i++) {
+            if (strcmp(builtin_formatters[i].typname, NameStr(type_form->typname)) == 0 &&
+                extname != NULL && strcmp(builtin_formatters[i].extname, extname) == 0) {
+                formatter = builtin_formatters[i].formatter;
+                *send = builtin_formatters[i].send;
+                break;
+            }
+        }
+    }
+
+    ReleaseSysCache(type_tuple);
+
+    return formatter;
+}
+
+/*
+ * Built-in formatters.
+ */
+
+/*
+ * float4/float8 as the shortest text that reads back to the same value,
+ * without going through float4out/float8out and extra_float_digits.
+ */
+static void float4_to_json(StringInfo s, Oid typid, Datum value) {
+    enlargeStringInfo(s, RYU_FLOAT_BUFLEN);
+    s->len += ryu_float_to_chars(DatumGetFloat4(value), s->data + s->len);
+}
+
+static void float8_to_json(StringInfo s, Oid typid, Datum value) {
+    enlargeStringInfo(s, RYU_DOUBLE_BUFLEN);
+    s->len += ryu_double_to_chars(DatumGetFloat8(value), s->data + s->len);
+}
+
+/* hstore on-disk layout, see contrib/hstore/hstore.h */
+typedef struct {
+    int32 vl_len_;
+    uint32 size_;
+} HStoreHeader;
+
+#define HSTORE_FLAG_NEWVERSION 0x80000000
+#define HSTORE_COUNT(hs) ((hs)->size_ & 0x0FFFFFFF)
+#define HSTORE_ENTRY_ISFIRST 0x80000000
+#define HSTORE_ENTRY_ISNULL 0x40000000
+#define HSTORE_ENTRY_POSMASK 0x3FFFFFFF
+
+static void hstore_append_string(StringInfo s, uint32 *entries, char *strings, int index) {
+    uint32 start;
+    uint32 end;
+
+    end = entries[index] & HSTORE_ENTRY_POSMASK;
+    start = (entries[index] & HSTORE_ENTRY_ISFIRST) ? 0 : (entries[index - 1] & HSTORE_ENTRY_POSMASK);
+
+    escape_json(s, pnstrdup(strings + start, end - start));
+}
+
+static void hstore_to_json(StringInfo s, Oid typid, Datum value) {
+    HStoreHeader *hs = (HStoreHeader *) DatumGetPointer(value);
+    uint32 *entries;
+    char *strings;
+    uint32 count;
+    uint32 i;
+
+    /* pre-9.0 layouts are only upgraded by hstore itself */
+    if ((hs->size_ & HSTORE_FLAG_NEWVERSION) == 0) {
+        Oid typoutput;
+        bool typisvarlena;
+
+        getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+        escape_json(s, OidOutputFunctionCall(typoutput, value));
+        return;
+    }
+
+    count = HSTORE_COUNT(hs);
+    entries = (uint32 *) (hs + 1);
+    strings = (char *) (entries + count * 2);
+
+    appendStringInfoChar(s, '{');
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            appendStringInfoChar(s, ',');
+        }
+
+        hstore_append_string(s, entries, strings, i * 2);
+        appendStringInfoChar(s, ':');
+
+        if (entries[i * 2 + 1] & HSTORE_ENTRY_ISNULL) {
+            appendStringInfoString(s, "null");
+        } else {
+            hstore_append_string(s, entries, strings, i * 2 + 1);
+        }
+    }
+    appendStringInfoChar(s, '}');
+}
+
+/* pgvector on-disk layout */
+typedef struct {
+    int32 vl_len_;
+    int16 dim;
+    int16 unused;
+    float4 x[FLEXIBLE_ARRAY_MEMBER];
+} VectorHeader;
+
+static void vector_to_json(StringInfo s, Oid typid, Datum value) {
+    VectorHeader *vector = (VectorHeader *) DatumGetPointer(value);
+    int i;
+
+    appendStringInfoChar(s, '[');
+    for (i = 0; i < vector->dim; i++) {
+        if (i > 0) {
+            appendStringInfoChar(s, ',');
+        }
+        enlargeStringInfo(s, RYU_FLOAT_BUFLEN);
+        s->len += ryu_float_to_chars(vector->x[i], s->data + s->len);
+    }
+    appendStringInfoChar(s, ']');
+}
+
+/*
+ * PostGIS geometry as hex EWKB, the same text geometry_out produces, taken
+ * from the binary send function without the intermediate cstring.
+ */
+static void geometry_to_json(StringInfo s, Oid typsend, Datum value) {
+    static const char hex[] = "0123456789ABCDEF";
+    bytea *wkb;
+    unsigned char *bytes;
+    int len;
+    int i;
+
+    wkb = OidSendFunctionCall(typsend, value);
+    bytes = (unsigned char *) VARDATA(wkb);
+    len = VARSIZE(wkb) - VARHDRSZ;
+
+    enlargeStringInfo(s, len * 2 + 2);
+    s->data[s->len++] = '"';
+    for (i = 0; i < len; i++) {
+        s->data[s->len++] = hex[bytes[i] >> 4];
+        s->data[s->len++] = hex[bytes[i] & 0x0F];
+    }
+    s->data[s->len++] = '"';
+    s->data[s->len] = '\0';
+}
+
+void reportErrorInvalidParam(DefElem *elem) {
+    ereport(ERROR,
             (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                     errmsg("could not parse value \"%s\" for parameter \"%s\"",
                            strVal(elem->arg), elem->defname)));
@@ -425,6 +2114,33 @@ bool hasParameter(DefElem *elem, char *param) {
     return strcmp(elem->defname, param) == 0;
 }
 
+/*
+ * Comma-separated values, empty ones are dropped.
+ */
+List *split_list(const char *value) {
+    List *list = NIL;
+    const char *start = value;
+    const char *end;
+
+    for (;;) {
+        end = strchr(start, ',');
+        if (end == NULL) {
+            end = start + strlen(start);
+        }
+
+        if (end > start) {
+            list = lappend(list, pnstrdup(start, end - start));
+        }
+
+        if (*end == '\0') {
+            break;
+        }
+        start = end + 1;
+    }
+
+    return list;
+}
+
 bool isSystemColumn(Form_pg_attribute attr) {
     return attr->attnum < 0;
 }
@@ -0,0 +1,72 @@
+#ifndef JSON_DECODING_H
+#define JSON_DECODING_H
+
+#include "fmgr.h"
+#include "lib/stringinfo.h"
+#include "utils/memutils.h"
+
+/*
+ * Type formatter registry.
+ *
+ * A formatter writes a complete JSON value for a non-null, already detoasted
+ * Datum of the type it was registered for, with strings escaped like
+ * escape_json does. Formatters are registered by type
+ * name (either "typname" or "schema.typname") and are resolved to type OIDs
+ * the first time a relation using the type is decoded.
+ *
+ * Other libraries can register formatters from their own _PG_init without
+ * linking against json_decoding, in any load order:
+ *
+ *     json_decoding_register_type_formatter("mytype", mytype_to_json);
+ *
+ * A registered formatter takes precedence over the built-in one for a type
+ * of the same name, and a later registration over an earlier one.
+ */
+typedef void (*JsonDecodingTypeFormatter)(StringInfo s, Oid typid, Datum value);
+
+typedef struct {
+    const char *typname;
+    JsonDecodingTypeFormatter formatter;
+} JsonDecodingTypeFormatterEntry;
+
+typedef struct {
+    int count;
+    int capacity;
+    JsonDecodingTypeFormatterEntry *entries;
+} JsonDecodingTypeFormatterRegistry;
+
+#define JSON_DECODING_FORMATTER_RENDEZVOUS "json_decoding_type_formatters"
+
+static inline JsonDecodingTypeFormatterRegistry *
+json_decoding_type_formatter_registry(void) {
+    JsonDecodingTypeFormatterRegistry **registry;
+
+    registry = (JsonDecodingTypeFormatterRegistry **) find_rendezvous_variable(JSON_DECODING_FORMATTER_RENDEZVOUS);
+
+    if (*registry == NULL) {
+        *registry = MemoryContextAllocZero(TopMemoryContext, sizeof(JsonDecodingTypeFormatterRegistry));
+    }
+
+    return *registry;
+}
+
+static inline void
+json_decoding_register_type_formatter(const char *typname, JsonDecodingTypeFormatter formatter) {
+    JsonDecodingTypeFormatterRegistry *registry = json_decoding_type_formatter_registry();
+    JsonDecodingTypeFormatterEntry *entry;
+
+    if (registry->count == registry->capacity) {
+        registry->capacity = registry->capacity == 0 ? 8 : registry->capacity * 2;
+        registry->entries = registry->entries == NULL ?
+                            MemoryContextAlloc(TopMemoryContext,
+                                               registry->capacity * sizeof(JsonDecodingTypeFormatterEntry)) :
+                            repalloc(registry->entries,
+                                     registry->capacity * sizeof(JsonDecodingTypeFormatterEntry));
+    }
+
+    entry = &registry->entries[registry->count++];
+    entry->typname = MemoryContextStrdup(TopMemoryContext, typname);
+    entry->formatter = formatter;
+}
+
+#endif
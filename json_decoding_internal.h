@@ -0,0 +1,383 @@
+#ifndef JSON_DECODING_INTERNAL_H
+#define JSON_DECODING_INTERNAL_H
+
+#include "portability/instr_time.h"
+
+#include "replication/logical.h"
+#include "replication/reorderbuffer.h"
+
+#include "utils/array.h"
+#include "utils/hsearch.h"
+
+#include "json_decoding.h"
+
+typedef enum {
+    FORMAT_JSON,
+    FORMAT_MSGPACK,
+    FORMAT_AVRO,
+    FORMAT_ARROW,
+    FORMAT_COPY
+} JsonDecodingFormat;
+
+/* values are the method byte of the frame header */
+typedef enum {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_PGLZ = 1,
+    COMPRESSION_LZ4 = 2,
+    COMPRESSION_ZSTD = 3
+} JsonDecodingCompression;
+
+/* the commit time moved into a union with the prepare time in 14 */
+#if PG_VERSION_NUM >= 140000
+#define TXN_COMMIT_TIME(txn) ((txn)->xact_time.commit_time)
+#else
+#define TXN_COMMIT_TIME(txn) ((txn)->commit_time)
+#endif
+
+/* fixed keys of the LSN fields and transaction events */
+#define KEY_LSN "pg_change_lsn"
+#define KEY_COMMIT_LSN "pg_change_commit_lsn"
+#define KEY_SEQ "pg_change_seq"
+#define KEY_PREPARE_LSN "pg_change_prepare_lsn"
+#define KEY_GID "pg_change_gid"
+#define KEY_CHUNK "pg_change_chunk"
+#define KEY_TRANSACTIONAL "pg_change_transactional"
+#define KEY_PREFIX "pg_change_prefix"
+#define KEY_CONTENT "pg_change_content"
+#define KEY_TABLES "pg_change_tables"
+#define KEY_CASCADE "pg_change_cascade"
+#define KEY_RESTART_IDENTITY "pg_change_restart_identity"
+#define KEY_END_LSN "pg_change_end_lsn"
+#define KEY_CHANGE_COUNT "pg_change_count"
+#define KEY_DECODE_LAG "pg_change_decode_lag_ms"
+
+/*
+ * Log-linear histograms: four linear buckets per power of two, so a bucket
+ * is at most a quarter of its lower bound wide. The last bucket takes every
+ * value from 7 * 2^30 up.
+ */
+#define HISTOGRAM_BUCKETS 128
+
+/*
+ * Counters of the slot statistics, see stats.c. serialize_time is in
+ * microseconds once published; change times are in microseconds and
+ * message sizes in bytes.
+ */
+typedef struct {
+    int64 inserts;
+    int64 updates;
+    int64 deletes;
+    int64 truncates;
+    int64 messages;
+    int64 transactions;
+    int64 filtered;
+    int64 bytes;
+    int64 max_message_bytes;
+    int64 serialize_time;
+    int64 detoasted;
+    int64 detoasted_bytes;
+    /* a gauge: milliseconds from commit to decoding of the last transaction */
+    int64 decode_lag;
+    int64 change_time_histogram[HISTOGRAM_BUCKETS];
+    int64 message_size_histogram[HISTOGRAM_BUCKETS];
+} JsonDecodingCounters;
+
+/*
+ * Fixed JSON fragments, rendered once at startup from the compact and key
+ * options. Every field after the first is written as its prefix (separator,
+ * key and colon) followed by the value.
+ */
+typedef struct {
+    char *table;
+    char *timestamp;
+    char *xid;
+    char *lsn;
+    char *commit_lsn;
+    char *seq;
+    char *decode_lag;
+    char *type;
+    char *old_key;
+    char *separator;
+    char *close;
+} JsonDecodingFragments;
+
+typedef struct {
+    MemoryContext context;
+    JsonDecodingFormat format;
+    JsonDecodingCompression compression;
+    StringInfoData compress_buffer;
+    int write_start;
+    bool include_xids;
+    bool include_timestamp;
+    bool include_lsn;
+    bool include_decode_lag;
+    bool include_transaction;
+    bool two_phase;
+    bool skip_empty_xacts;
+    bool xact_wrote_changes;
+    int64 xact_changes;
+    int max_chunk_changes;
+    int max_chunk_bytes;
+    int64 chunk_index;
+    int64 chunk_changes;
+    int64 chunk_bytes;
+    int heartbeat_interval;
+    TimestampTz last_heartbeat;
+    bool only_local;
+    bool include_messages;
+    List *message_prefixes;
+    bool include_toast_datum;
+    bool compact;
+    bool omit_nulls;
+    char *key_table;
+    char *key_timestamp;
+    char *key_xid;
+    char *key_type;
+    char *key_old_primary_key;
+    JsonDecodingFragments fragments;
+    int arrow_batch_rows;
+    MemoryContext arrow_context;
+    List *arrow_batches;
+    int64 arrow_buffered_bytes;
+    bool relation_stats;
+    /* bytes of arrow batches and COPY runs, charged to their relation when flushed */
+    int64 flushed_bytes;
+    int log_slow_change;
+    bool coalesce_rows;
+    int coalesce_memory;
+    bool coalesce_overflow;
+    MemoryContext coalesce_context;
+    HTAB *coalesce_rows_hash;
+    List *coalesce_entries;
+    List *coalesce_relations;
+    Size coalesce_size;
+    StringInfoData copy_buffer;
+    struct JsonDecodingRelation *copy_relinfo;
+    Oid copy_relid;
+    uint32 copy_generation;
+    int64 copy_rows;
+    bool track_stats;
+    int stats_index;
+    JsonDecodingCounters counters;
+    instr_time serialize_time;
+    TransactionId xid;
+    TimestampTz commit_time;
+} JsonDecodingData;
+
+/*
+ * How a column's Datum can be written natively by the binary formats;
+ * everything else goes through the type output function.
+ */
+typedef enum {
+    COLUMN_KIND_OTHER,
+    COLUMN_KIND_BOOL,
+    COLUMN_KIND_INT2,
+    COLUMN_KIND_INT4,
+    COLUMN_KIND_INT8,
+    COLUMN_KIND_OID,
+    COLUMN_KIND_FLOAT4,
+    COLUMN_KIND_FLOAT8,
+    COLUMN_KIND_TIMESTAMP,
+    COLUMN_KIND_TIMESTAMPTZ,
+    COLUMN_KIND_TEXT,
+    COLUMN_KIND_BYTEA
+} JsonDecodingColumnKind;
+
+/*
+ * Per-relation output plan, built the first time a relation is decoded and
+ * rebuilt after a relcache or type invalidation.
+ */
+typedef struct {
+    bool skip;
+    Oid typid;
+    Oid typoutput;
+    bool typisvarlena;
+    JsonDecodingColumnKind kind;
+    Oid typsend;
+    bool identity;
+    bool generated;
+    char *name;
+    char *key;
+    JsonDecodingTypeFormatter formatter;
+    /* passed to the formatter: typid, or typsend for a built-in taking it */
+    Oid formatter_oid;
+} JsonDecodingColumn;
+
+/* relation-stats accounting of a column */
+typedef struct {
+    int64 values;
+    int64 bytes;
+    instr_time time;
+} JsonDecodingColumnStats;
+
+typedef struct JsonDecodingRelation {
+    Oid relid;
+    bool valid;
+    uint32 generation;
+    MemoryContext context;
+    char *table_name;
+    char *table_json;
+    /* the replica identity is an index, so rows have a unique key */
+    bool keyed;
+    int natts;
+    JsonDecodingColumn *columns;
+    Datum *values;
+    bool *nulls;
+    /* format=msgpack; the old key of an update, deformed next to the new tuple */
+    Datum *old_values;
+    bool *old_nulls;
+    /* format=avro; the sent fingerprint survives plan rebuilds */
+    char *avro_schema;
+    uint64 avro_fingerprint;
+    bool avro_schema_sent;
+    uint64 avro_sent_fingerprint;
+    /* relation-stats; by attribute number, kept across plan rebuilds */
+    int64 stats_rows;
+    int64 stats_bytes;
+    instr_time stats_time;
+    int stats_ncolumns;
+    JsonDecodingColumnStats *column_stats;
+} JsonDecodingRelation;
+
+typedef struct {
+    JsonDecodingData *data;
+    StringInfo s;
+    int nfields;
+    int count_position;
+} JsonDecodingEvent;
+
+extern void pg_output_prepare(LogicalDecodingContext *ctx, bool last_write);
+
+extern void pg_output_write(LogicalDecodingContext *ctx, bool last_write);
+
+extern void pg_output_change(LogicalDecodingContext *ctx,
+                             JsonDecodingData *data,
+                             JsonDecodingRelation *relinfo,
+                             TupleDesc tupdesc,
+                             ReorderBufferTXN *txn,
+                             ReorderBufferChange *change);
+
+extern JsonDecodingData *sql_decoding_data(ArrayType *options);
+
+extern JsonDecodingRelation *sql_relation_plan(JsonDecodingData *data, Relation relation);
+
+extern void sql_row_to_json(StringInfo s,
+                            JsonDecodingData *data,
+                            JsonDecodingRelation *relinfo,
+                            Relation relation,
+                            HeapTuple tuple);
+
+extern const char *change_type_name(ReorderBufferChangeType action);
+
+extern int64 timestamp_to_unix_micros(TimestampTz value);
+
+extern uint64 decode_lag_ms(ReorderBufferTXN *txn);
+
+/* msgpack.c */
+extern void change_to_msgpack(StringInfo s,
+                              JsonDecodingData *data,
+                              JsonDecodingRelation *relinfo,
+                              TupleDesc tupdesc,
+                              ReorderBufferTXN *txn,
+                              ReorderBufferChange *change);
+
+extern void msgpack_write_nil(StringInfo s);
+extern void msgpack_write_bool(StringInfo s, bool value);
+extern void msgpack_write_uint(StringInfo s, uint64 value);
+extern void msgpack_write_int(StringInfo s, int64 value);
+extern void msgpack_write_float4(StringInfo s, float4 value);
+extern void msgpack_write_float8(StringInfo s, float8 value);
+extern void msgpack_write_string(StringInfo s, const char *value, int len);
+extern void msgpack_write_cstring(StringInfo s, const char *value);
+extern void msgpack_write_binary(StringInfo s, const char *value, int len);
+extern void msgpack_write_map(StringInfo s, int count);
+extern void msgpack_write_array(StringInfo s, int count);
+extern void msgpack_write_timestamp(StringInfo s, TimestampTz value);
+
+/* avro.c */
+extern void avro_build_schema(JsonDecodingData *data,
+                              JsonDecodingRelation *relinfo,
+                              const char *nspname,
+                              const char *relname);
+
+extern bool avro_schema_pending(JsonDecodingRelation *relinfo);
+
+extern void avro_schema_message(StringInfo s, JsonDecodingRelation *relinfo);
+
+extern void change_to_avro(StringInfo s,
+                           JsonDecodingData *data,
+                           JsonDecodingRelation *relinfo,
+                           TupleDesc tupdesc,
+                           ReorderBufferTXN *txn,
+                           ReorderBufferChange *change);
+
+/* arrow.c */
+extern void arrow_append_change(LogicalDecodingContext *ctx,
+                                JsonDecodingData *data,
+                                JsonDecodingRelation *relinfo,
+                                TupleDesc tupdesc,
+                                ReorderBufferTXN *txn,
+                                ReorderBufferChange *change);
+
+extern void arrow_flush(LogicalDecodingContext *ctx, JsonDecodingData *data);
+
+/* copy.c */
+extern void copy_append_change(LogicalDecodingContext *ctx,
+                               JsonDecodingData *data,
+                               JsonDecodingRelation *relinfo,
+                               TupleDesc tupdesc,
+                               ReorderBufferChange *change);
+
+extern void copy_flush(LogicalDecodingContext *ctx, JsonDecodingData *data);
+
+/* coalesce.c */
+extern void coalesce_init(LogicalDecodingContext *ctx, JsonDecodingData *data);
+
+extern void coalesce_append_change(LogicalDecodingContext *ctx,
+                                   JsonDecodingData *data,
+                                   JsonDecodingRelation *relinfo,
+                                   TupleDesc tupdesc,
+                                   ReorderBufferTXN *txn,
+                                   ReorderBufferChange *change);
+
+extern void coalesce_check_plans(LogicalDecodingContext *ctx, JsonDecodingData *data, ReorderBufferTXN *txn);
+
+extern void coalesce_flush(LogicalDecodingContext *ctx, JsonDecodingData *data, ReorderBufferTXN *txn);
+
+/* events.c */
+extern void event_start(JsonDecodingEvent *event, JsonDecodingData *data, StringInfo s, const char *type);
+
+extern void event_add_string(JsonDecodingEvent *event, const char *key, const char *value);
+
+extern void event_add_uint(JsonDecodingEvent *event, const char *key, uint64 value);
+
+extern void event_add_strings(JsonDecodingEvent *event, const char *key, const char **values, int count);
+
+extern void event_add_bytes(JsonDecodingEvent *event, const char *key, const char *value, Size len);
+
+extern void event_add_bool(JsonDecodingEvent *event, const char *key, bool value);
+
+extern void event_add_lsn(JsonDecodingEvent *event, const char *key, XLogRecPtr value);
+
+extern void event_add_timestamp(JsonDecodingEvent *event, const char *key, TimestampTz value);
+
+extern void event_end(JsonDecodingEvent *event);
+
+/* stats.c */
+extern void stats_init(void);
+
+extern void stats_attach(JsonDecodingData *data);
+
+extern void stats_publish(JsonDecodingData *data);
+
+extern void stats_histogram_add(int64 *histogram, uint64 value);
+
+/* spool.c */
+extern void spool_init(void);
+
+/* compress.c */
+extern bool compression_supported(JsonDecodingCompression method);
+
+extern void compress_output(JsonDecodingData *data, StringInfo out, int start);
+
+#endif
@@ -0,0 +1,415 @@
+/*
+ * MessagePack output (format=msgpack).
+ *
+ * Every change is one map with the same keys as the JSON output. Integers,
+ * floats, booleans and timestamps are encoded natively from their Datums,
+ * text and bytea as length-prefixed raw bytes, and every other type as the
+ * string produced by its output function. Timestamps use the MessagePack
+ * timestamp extension type (-1).
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+
+#include "datatype/timestamp.h"
+
+#include "libpq/pqformat.h"
+
+#include "json_decoding_internal.h"
+
+#define MSGPACK_TIMESTAMP_EXT (-1)
+
+/*
+ * Helper Methods.
+ */
+static int deform_fields(JsonDecodingRelation *relinfo,
+                         TupleDesc tupdesc,
+                         HeapTuple tuple,
+                         Datum *values,
+                         bool *nulls,
+                         bool skip_nulls);
+
+static void tuple_to_msgpack_fields(StringInfo s,
+                                    JsonDecodingData *data,
+                                    JsonDecodingRelation *relinfo,
+                                    Datum *values,
+                                    bool *nulls,
+                                    bool skip_nulls);
+
+static void datum_to_msgpack(StringInfo s,
+                             JsonDecodingData *data,
+                             JsonDecodingColumn *column,
+                             Datum value);
+
+/*
+ * Implementation.
+ */
+
+void change_to_msgpack(StringInfo s,
+                       JsonDecodingData *data,
+                       JsonDecodingRelation *relinfo,
+                       TupleDesc tupdesc,
+                       ReorderBufferTXN *txn,
+                       ReorderBufferChange *change) {
+    HeapTuple oldtuple = change->data.tp.oldtuple != NULL ? &change->data.tp.oldtuple->tuple : NULL;
+    HeapTuple newtuple = change->data.tp.newtuple != NULL ? &change->data.tp.newtuple->tuple : NULL;
+    int nfields = 2;
+    int new_count = 0;
+    int old_count = 0;
+
+    if (data->include_timestamp) {
+        nfields++;
+    }
+    if (data->include_xids) {
+        nfields++;
+    }
+    if (data->include_lsn) {
+        nfields += 3;
+    }
+    if (data->include_decode_lag) {
+        nfields++;
+    }
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            oldtuple = NULL;
+            break;
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            if (oldtuple != NULL) {
+                nfields++;
+            }
+            break;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            newtuple = NULL;
+            break;
+        default:
+            Assert(false);
+    }
+
+    /*
+     * The map sizes come first, so each tuple is deformed once up front; the
+     * old key of an update goes to arrays of its own.
+     */
+    if (newtuple != NULL) {
+        new_count = deform_fields(relinfo, tupdesc, newtuple, relinfo->values, relinfo->nulls, data->omit_nulls);
+        nfields += new_count;
+
+        if (oldtuple != NULL) {
+            old_count = deform_fields(relinfo, tupdesc, oldtuple, relinfo->old_values, relinfo->old_nulls, true);
+        }
+    } else if (oldtuple != NULL) {
+        old_count = deform_fields(relinfo, tupdesc, oldtuple, relinfo->values, relinfo->nulls, true);
+        nfields += old_count;
+    }
+
+    msgpack_write_map(s, nfields);
+
+    msgpack_write_cstring(s, data->key_table);
+    msgpack_write_cstring(s, relinfo->table_name);
+
+    if (data->include_timestamp) {
+        msgpack_write_cstring(s, data->key_timestamp);
+        msgpack_write_timestamp(s, TXN_COMMIT_TIME(txn));
+    }
+
+    if (data->include_xids) {
+        msgpack_write_cstring(s, data->key_xid);
+        msgpack_write_uint(s, txn->xid);
+    }
+
+    if (data->include_lsn) {
+        msgpack_write_cstring(s, KEY_LSN);
+        msgpack_write_uint(s, change->lsn);
+        msgpack_write_cstring(s, KEY_COMMIT_LSN);
+        msgpack_write_uint(s, txn->final_lsn);
+        msgpack_write_cstring(s, KEY_SEQ);
+        msgpack_write_uint(s, data->xact_changes);
+    }
+
+    if (data->include_decode_lag) {
+        msgpack_write_cstring(s, KEY_DECODE_LAG);
+        msgpack_write_uint(s, decode_lag_ms(txn));
+    }
+
+    msgpack_write_cstring(s, data->key_type);
+    msgpack_write_cstring(s, change_type_name(change->action));
+
+    if (change->action == REORDER_BUFFER_CHANGE_UPDATE && oldtuple != NULL) {
+        msgpack_write_cstring(s, data->key_old_primary_key);
+        msgpack_write_map(s, old_count);
+        tuple_to_msgpack_fields(s, data, relinfo, relinfo->old_values, relinfo->old_nulls, true);
+    }
+
+    if (newtuple != NULL) {
+        tuple_to_msgpack_fields(s, data, relinfo, relinfo->values, relinfo->nulls, data->omit_nulls);
+    } else if (oldtuple != NULL) {
+        tuple_to_msgpack_fields(s, data, relinfo, relinfo->values, relinfo->nulls, true);
+    }
+}
+
+void msgpack_write_nil(StringInfo s) {
+    pq_sendbyte(s, 0xc0);
+}
+
+void msgpack_write_bool(StringInfo s, bool value) {
+    pq_sendbyte(s, value ? 0xc3 : 0xc2);
+}
+
+void msgpack_write_uint(StringInfo s, uint64 value) {
+    if (value <= 0x7f) {
+        pq_sendbyte(s, (uint8) value);
+    } else if (value <= PG_UINT8_MAX) {
+        pq_sendbyte(s, 0xcc);
+        pq_sendbyte(s, (uint8) value);
+    } else if (value <= PG_UINT16_MAX) {
+        pq_sendbyte(s, 0xcd);
+        pq_sendint16(s, (uint16) value);
+    } else if (value <= PG_UINT32_MAX) {
+        pq_sendbyte(s, 0xce);
+        pq_sendint32(s, (uint32) value);
+    } else {
+        pq_sendbyte(s, 0xcf);
+        pq_sendint64(s, value);
+    }
+}
+
+void msgpack_write_int(StringInfo s, int64 value) {
+    if (value >= 0) {
+        msgpack_write_uint(s, (uint64) value);
+    } else if (value >= -32) {
+        /* negative fixint */
+        pq_sendbyte(s, (uint8) (int8) value);
+    } else if (value >= PG_INT8_MIN) {
+        pq_sendbyte(s, 0xd0);
+        pq_sendbyte(s, (uint8) (int8) value);
+    } else if (value >= PG_INT16_MIN) {
+        pq_sendbyte(s, 0xd1);
+        pq_sendint16(s, (uint16) (int16) value);
+    } else if (value >= PG_INT32_MIN) {
+        pq_sendbyte(s, 0xd2);
+        pq_sendint32(s, (uint32) (int32) value);
+    } else {
+        pq_sendbyte(s, 0xd3);
+        pq_sendint64(s, (uint64) value);
+    }
+}
+
+void msgpack_write_float4(StringInfo s, float4 value) {
+    pq_sendbyte(s, 0xca);
+    pq_sendfloat4(s, value);
+}
+
+void msgpack_write_float8(StringInfo s, float8 value) {
+    pq_sendbyte(s, 0xcb);
+    pq_sendfloat8(s, value);
+}
+
+void msgpack_write_string(StringInfo s, const char *value, int len) {
+    if (len < 32) {
+        pq_sendbyte(s, 0xa0 | (uint8) len);
+    } else if (len <= PG_UINT8_MAX) {
+        pq_sendbyte(s, 0xd9);
+        pq_sendbyte(s, (uint8) len);
+    } else if (len <= PG_UINT16_MAX) {
+        pq_sendbyte(s, 0xda);
+        pq_sendint16(s, (uint16) len);
+    } else {
+        pq_sendbyte(s, 0xdb);
+        pq_sendint32(s, (uint32) len);
+    }
+    pq_sendbytes(s, value, len);
+}
+
+void msgpack_write_cstring(StringInfo s, const char *value) {
+    msgpack_write_string(s, value, strlen(value));
+}
+
+void msgpack_write_binary(StringInfo s, const char *value, int len) {
+    if (len <= PG_UINT8_MAX) {
+        pq_sendbyte(s, 0xc4);
+        pq_sendbyte(s, (uint8) len);
+    } else if (len <= PG_UINT16_MAX) {
+        pq_sendbyte(s, 0xc5);
+        pq_sendint16(s, (uint16) len);
+    } else {
+        pq_sendbyte(s, 0xc6);
+        pq_sendint32(s, (uint32) len);
+    }
+    pq_sendbytes(s, value, len);
+}
+
+void msgpack_write_map(StringInfo s, int count) {
+    if (count < 16) {
+        pq_sendbyte(s, 0x80 | (uint8) count);
+    } else if (count <= PG_UINT16_MAX) {
+        pq_sendbyte(s, 0xde);
+        pq_sendint16(s, (uint16) count);
+    } else {
+        pq_sendbyte(s, 0xdf);
+        pq_sendint32(s, (uint32) count);
+    }
+}
+
+void msgpack_write_array(StringInfo s, int count) {
+    if (count < 16) {
+        pq_sendbyte(s, 0x90 | (uint8) count);
+    } else if (count <= PG_UINT16_MAX) {
+        pq_sendbyte(s, 0xdc);
+        pq_sendint16(s, (uint16) count);
+    } else {
+        pq_sendbyte(s, 0xdd);
+        pq_sendint32(s, (uint32) count);
+    }
+}
+
+/*
+ * Timestamps in the smallest of the timestamp 32/64/96 layouts. Infinite
+ * values have no MessagePack representation and are written as strings.
+ */
+void msgpack_write_timestamp(StringInfo s, TimestampTz value) {
+    int64 seconds;
+    int64 usecs;
+    uint32 nsecs;
+
+    if (TIMESTAMP_NOT_FINITE(value)) {
+        msgpack_write_cstring(s, TIMESTAMP_IS_NOBEGIN(value) ? "-infinity" : "infinity");
+        return;
+    }
+
+    seconds = value / USECS_PER_SEC;
+    usecs = value % USECS_PER_SEC;
+    if (usecs < 0) {
+        usecs += USECS_PER_SEC;
+        seconds--;
+    }
+    seconds += (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY;
+    nsecs = (uint32) usecs * 1000;
+
+    if ((seconds >> 34) == 0) {
+        uint64 data64 = ((uint64) nsecs << 34) | (uint64) seconds;
+
+        if ((data64 & UINT64CONST(0xffffffff00000000)) == 0) {
+            pq_sendbyte(s, 0xd6);
+            pq_sendbyte(s, (uint8) (int8) MSGPACK_TIMESTAMP_EXT);
+            pq_sendint32(s, (uint32) data64);
+        } else {
+            pq_sendbyte(s, 0xd7);
+            pq_sendbyte(s, (uint8) (int8) MSGPACK_TIMESTAMP_EXT);
+            pq_sendint64(s, data64);
+        }
+    } else {
+        pq_sendbyte(s, 0xc7);
+        pq_sendbyte(s, 12);
+        pq_sendbyte(s, (uint8) (int8) MSGPACK_TIMESTAMP_EXT);
+        pq_sendint32(s, nsecs);
+        pq_sendint64(s, (uint64) seconds);
+    }
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * Deform the tuple into values and nulls, and count the fields it will
+ * write.
+ */
+static int deform_fields(JsonDecodingRelation *relinfo,
+                         TupleDesc tupdesc,
+                         HeapTuple tuple,
+                         Datum *values,
+                         bool *nulls,
+                         bool skip_nulls) {
+    int count = 0;
+    int natt;
+
+    heap_deform_tuple(tuple, tupdesc, values, nulls);
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        if (relinfo->columns[natt].skip || (skip_nulls && nulls[natt])) {
+            continue;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static void tuple_to_msgpack_fields(StringInfo s,
+                                    JsonDecodingData *data,
+                                    JsonDecodingRelation *relinfo,
+                                    Datum *values,
+                                    bool *nulls,
+                                    bool skip_nulls) {
+    int natt;
+
+    for (natt = 0; natt < relinfo->natts; natt++) {
+        JsonDecodingColumn *column = &relinfo->columns[natt];
+
+        if (column->skip || (nulls[natt] && skip_nulls)) {
+            continue;
+        }
+
+        msgpack_write_cstring(s, column->name);
+
+        if (nulls[natt]) {
+            msgpack_write_nil(s);
+        } else {
+            datum_to_msgpack(s, data, column, values[natt]);
+        }
+    }
+}
+
+static void datum_to_msgpack(StringInfo s,
+                             JsonDecodingData *data,
+                             JsonDecodingColumn *column,
+                             Datum value) {
+    struct varlena *detoasted;
+
+    if (column->typisvarlena && VARATT_IS_EXTERNAL_ONDISK(value) && !data->include_toast_datum) {
+        msgpack_write_cstring(s, "unchanged-toast-datum");
+        return;
+    }
+
+    switch (column->kind) {
+        case COLUMN_KIND_BOOL:
+            msgpack_write_bool(s, DatumGetBool(value));
+            break;
+        case COLUMN_KIND_INT2:
+            msgpack_write_int(s, DatumGetInt16(value));
+            break;
+        case COLUMN_KIND_INT4:
+            msgpack_write_int(s, DatumGetInt32(value));
+            break;
+        case COLUMN_KIND_INT8:
+            msgpack_write_int(s, DatumGetInt64(value));
+            break;
+        case COLUMN_KIND_OID:
+            msgpack_write_uint(s, DatumGetObjectId(value));
+            break;
+        case COLUMN_KIND_FLOAT4:
+            msgpack_write_float4(s, DatumGetFloat4(value));
+            break;
+        case COLUMN_KIND_FLOAT8:
+            msgpack_write_float8(s, DatumGetFloat8(value));
+            break;
+        case COLUMN_KIND_TIMESTAMP:
+        case COLUMN_KIND_TIMESTAMPTZ:
+            msgpack_write_timestamp(s, DatumGetTimestampTz(value));
+            break;
+        case COLUMN_KIND_TEXT:
+            detoasted = PG_DETOAST_DATUM_PACKED(value);
+            msgpack_write_string(s, VARDATA_ANY(detoasted), VARSIZE_ANY_EXHDR(detoasted));
+            break;
+        case COLUMN_KIND_BYTEA:
+            detoasted = PG_DETOAST_DATUM_PACKED(value);
+            msgpack_write_binary(s, VARDATA_ANY(detoasted), VARSIZE_ANY_EXHDR(detoasted));
+            break;
+        default:
+            if (column->typisvarlena) {
+                value = PointerGetDatum(PG_DETOAST_DATUM(value));
+            }
+            msgpack_write_cstring(s, OidOutputFunctionCall(column->typoutput, value));
+            break;
+    }
+}
@@ -0,0 +1,520 @@
+/*
+ * Shortest round-trip float formatting.
+ *
+ * This is Ulf Adams' Ryu algorithm (https://github.com/ulfjack/ryu, Apache
+ * 2.0 / Boost), reduced to what the plugin needs: float4 and float8 to the
+ * shortest decimal string that reads back to the same value. The output
+ * matches float4out/float8out of PostgreSQL 12+ with extra_float_digits > 0,
+ * so decoded values are identical on every server version and for every
+ * extra_float_digits setting.
+ */
+#include "postgres.h"
+
+#include "ryu.h"
+#include "ryu_tables.h"
+
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_EXPONENT_BITS 11
+#define DOUBLE_BIAS 1023
+
+#define FLOAT_MANTISSA_BITS 23
+#define FLOAT_EXPONENT_BITS 8
+#define FLOAT_BIAS 127
+
+/* largest decimal exponent written in fixed-point notation, as printf %g */
+#define DOUBLE_FIXED_MAX_EXPONENT 14
+#define FLOAT_FIXED_MAX_EXPONENT 5
+#define FIXED_MIN_EXPONENT (-4)
+
+typedef struct {
+    uint64 mantissa;
+    int32 exponent;
+} DecimalFloat;
+
+/*
+ * Helper Methods.
+ */
+
+/* ceil(log2(5^e)) for 0 <= e <= 3528 */
+static inline int32 pow5bits(const int32 e) {
+    return (int32) (((uint32) e * 1217359) >> 19) + 1;
+}
+
+/* floor(log10(2^e)) for 0 <= e <= 1650 */
+static inline uint32 log10Pow2(const int32 e) {
+    return ((uint32) e * 78913) >> 18;
+}
+
+/* floor(log10(5^e)) for 0 <= e <= 2620 */
+static inline uint32 log10Pow5(const int32 e) {
+    return ((uint32) e * 732923) >> 20;
+}
+
+static inline uint32 pow5Factor(uint64 value) {
+    uint32 count = 0;
+
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+    return count;
+}
+
+static inline bool multipleOfPowerOf5(const uint64 value, const uint32 p) {
+    return pow5Factor(value) >= p;
+}
+
+static inline bool multipleOfPowerOf2(const uint64 value, const uint32 p) {
+    return (value & ((UINT64CONST(1) << p) - 1)) == 0;
+}
+
+static inline int decimalLength(const uint64 v) {
+    uint64 threshold = 10;
+    int length = 1;
+
+    /* mantissas have at most 17 digits */
+    while (length < 17 && v >= threshold) {
+        length++;
+        threshold *= 10;
+    }
+    return length;
+}
+
+#ifdef HAVE_INT128
+
+static inline uint64 mulShift64(const uint64 m, const uint64 *const mul, const int32 j) {
+    const uint128 b0 = ((uint128) m) * mul[0];
+    const uint128 b2 = ((uint128) m) * mul[1];
+
+    return (uint64) (((b0 >> 64) + b2) >> (j - 64));
+}
+
+#else
+
+static inline uint64 umul128(const uint64 a, const uint64 b, uint64 *const productHi) {
+    const uint32 aLo = (uint32) a;
+    const uint32 aHi = (uint32) (a >> 32);
+    const uint32 bLo = (uint32) b;
+    const uint32 bHi = (uint32) (b >> 32);
+    const uint64 b00 = (uint64) aLo * bLo;
+    const uint64 b01 = (uint64) aLo * bHi;
+    const uint64 b10 = (uint64) aHi * bLo;
+    const uint64 b11 = (uint64) aHi * bHi;
+    const uint64 mid1 = b10 + (b00 >> 32);
+    const uint64 mid2 = b01 + (uint32) mid1;
+
+    *productHi = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32) b00;
+}
+
+static inline uint64 mulShift64(const uint64 m, const uint64 *const mul, const int32 j) {
+    uint64 high0;
+    uint64 high1;
+    uint64 low1;
+    uint64 sum;
+
+    (void) umul128(m, mul[0], &high0);
+    low1 = umul128(m, mul[1], &high1);
+    sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
+    }
+
+    /* 64 < j < 128 for every exponent reachable from a double */
+    return (high1 << (128 - j)) | (sum >> (j - 64));
+}
+
+#endif
+
+static inline uint32 mulShift32(const uint32 m, const uint64 factor, const int32 shift) {
+    const uint64 bits0 = (uint64) m * (uint32) factor;
+    const uint64 bits1 = (uint64) m * (uint32) (factor >> 32);
+
+    return (uint32) (((bits0 >> 32) + bits1) >> (shift - 32));
+}
+
+static DecimalFloat double_to_decimal(const uint64 ieeeMantissa, const uint32 ieeeExponent) {
+    DecimalFloat result;
+    int32 e2;
+    uint64 m2;
+    bool acceptBounds;
+    uint64 mv;
+    uint32 mmShift;
+    uint64 vr;
+    uint64 vp;
+    uint64 vm;
+    int32 e10;
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+    int32 removed = 0;
+    uint8 lastRemovedDigit = 0;
+    uint64 output;
+
+    if (ieeeExponent == 0) {
+        e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int32) ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (UINT64CONST(1) << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+    }
+    acceptBounds = (m2 & 1) == 0;
+
+    /* interval of valid decimal representations, scaled by 4 */
+    mv = 4 * m2;
+    mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+    if (e2 >= 0) {
+        const uint32 q = log10Pow2(e2) - (e2 > 3);
+        const int32 k = DOUBLE_POW5_INV_BITCOUNT + pow5bits((int32) q) - 1;
+        const int32 i = -e2 + (int32) q + k;
+
+        e10 = (int32) q;
+        vr = mulShift64(4 * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_INV_SPLIT[q], i);
+
+        if (q <= 21) {
+            /* only one of mp, mv and mm can be a multiple of 5, if any */
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+            } else {
+                vp -= multipleOfPowerOf5(mv + 2, q);
+            }
+        }
+    } else {
+        const uint32 q = log10Pow5(-e2) - (-e2 > 1);
+        const int32 i = -e2 - (int32) q;
+        const int32 k = pow5bits(i) - DOUBLE_POW5_BITCOUNT;
+        const int32 j = (int32) q - k;
+
+        e10 = (int32) q + e2;
+        vr = mulShift64(4 * m2, DOUBLE_POW5_SPLIT[i], j);
+        vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_SPLIT[i], j);
+        vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_SPLIT[i], j);
+
+        if (q <= 1) {
+            /* mv = 4 * m2 always has at least two trailing 0 bits */
+            vrIsTrailingZeros = true;
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+        }
+    }
+
+    /* find the shortest representation in the interval */
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (uint8) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (uint8) (vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+            /* round to even if the exact value is .....50..0 */
+            lastRemovedDigit = 4;
+        }
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+    } else {
+        bool roundUp = false;
+
+        if (vp / 100 > vm / 100) {
+            roundUp = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        while (vp / 10 > vm / 10) {
+            roundUp = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+
+    result.mantissa = output;
+    result.exponent = e10 + removed;
+    return result;
+}
+
+static DecimalFloat float_to_decimal(const uint32 ieeeMantissa, const uint32 ieeeExponent) {
+    DecimalFloat result;
+    int32 e2;
+    uint32 m2;
+    bool acceptBounds;
+    uint32 mv;
+    uint32 mp;
+    uint32 mm;
+    uint32 mmShift;
+    uint32 vr;
+    uint32 vp;
+    uint32 vm;
+    int32 e10;
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+    uint8 lastRemovedDigit = 0;
+    int32 removed = 0;
+    uint32 output;
+
+    if (ieeeExponent == 0) {
+        e2 = 1 - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int32) ieeeExponent - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = (1u << FLOAT_MANTISSA_BITS) | ieeeMantissa;
+    }
+    acceptBounds = (m2 & 1) == 0;
+
+    mv = 4 * m2;
+    mp = 4 * m2 + 2;
+    mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+    mm = 4 * m2 - 1 - mmShift;
+
+    if (e2 >= 0) {
+        const uint32 q = log10Pow2(e2);
+        const int32 k = FLOAT_POW5_INV_BITCOUNT + pow5bits((int32) q) - 1;
+        const int32 i = -e2 + (int32) q + k;
+
+        e10 = (int32) q;
+        vr = mulShift32(mv, FLOAT_POW5_INV_SPLIT[q], i);
+        vp = mulShift32(mp, FLOAT_POW5_INV_SPLIT[q], i);
+        vm = mulShift32(mm, FLOAT_POW5_INV_SPLIT[q], i);
+
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            /* one removed digit is needed even if the loop below won't run */
+            const int32 l = FLOAT_POW5_INV_BITCOUNT + pow5bits((int32) (q - 1)) - 1;
+
+            lastRemovedDigit = (uint8) (mulShift32(mv, FLOAT_POW5_INV_SPLIT[q - 1], -e2 + (int32) q - 1 + l) % 10);
+        }
+        if (q <= 9) {
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPowerOf5(mm, q);
+            } else {
+                vp -= multipleOfPowerOf5(mp, q);
+            }
+        }
+    } else {
+        const uint32 q = log10Pow5(-e2);
+        const int32 i = -e2 - (int32) q;
+        const int32 k = pow5bits(i) - FLOAT_POW5_BITCOUNT;
+        int32 j = (int32) q - k;
+
+        e10 = (int32) q + e2;
+        vr = mulShift32(mv, FLOAT_POW5_SPLIT[i], j);
+        vp = mulShift32(mp, FLOAT_POW5_SPLIT[i], j);
+        vm = mulShift32(mm, FLOAT_POW5_SPLIT[i], j);
+
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            j = (int32) q - 1 - (pow5bits(i + 1) - FLOAT_POW5_BITCOUNT);
+            lastRemovedDigit = (uint8) (mulShift32(mv, FLOAT_POW5_SPLIT[i + 1], j) % 10);
+        }
+        if (q <= 1) {
+            vrIsTrailingZeros = true;
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 31) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q - 1);
+        }
+    }
+
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (uint8) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (uint8) (vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+            lastRemovedDigit = 4;
+        }
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+    } else {
+        while (vp / 10 > vm / 10) {
+            lastRemovedDigit = (uint8) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || lastRemovedDigit >= 5);
+    }
+
+    result.mantissa = output;
+    result.exponent = e10 + removed;
+    return result;
+}
+
+static int copy_special(char *result, bool sign, bool nan) {
+    const char *text = nan ? "NaN" : (sign ? "-Infinity" : "Infinity");
+    int len = strlen(text);
+
+    memcpy(result, text, len + 1);
+    return len;
+}
+
+/*
+ * Write mantissa * 10^exponent in fixed-point notation when its decimal
+ * exponent lies in [FIXED_MIN_EXPONENT, fixed_max_exponent], otherwise in
+ * scientific notation with at least two exponent digits, as printf %g does.
+ */
+static int format_decimal(DecimalFloat v, bool sign, int fixed_max_exponent, char *result) {
+    char digits[20];
+    int olength = decimalLength(v.mantissa);
+    int scientific_exponent = v.exponent + olength - 1;
+    uint64 mantissa = v.mantissa;
+    int index = 0;
+    int i;
+
+    for (i = olength - 1; i >= 0; i--) {
+        digits[i] = (char) ('0' + mantissa % 10);
+        mantissa /= 10;
+    }
+
+    if (sign) {
+        result[index++] = '-';
+    }
+
+    if (scientific_exponent >= FIXED_MIN_EXPONENT && scientific_exponent <= fixed_max_exponent) {
+        if (scientific_exponent < 0) {
+            /* 0.000ddd */
+            result[index++] = '0';
+            result[index++] = '.';
+            for (i = -1; i > scientific_exponent; i--) {
+                result[index++] = '0';
+            }
+            memcpy(result + index, digits, olength);
+            index += olength;
+        } else if (v.exponent >= 0) {
+            /* ddd000 */
+            memcpy(result + index, digits, olength);
+            index += olength;
+            for (i = 0; i < v.exponent; i++) {
+                result[index++] = '0';
+            }
+        } else {
+            /* dd.ddd */
+            memcpy(result + index, digits, scientific_exponent + 1);
+            index += scientific_exponent + 1;
+            result[index++] = '.';
+            memcpy(result + index, digits + scientific_exponent + 1, olength - scientific_exponent - 1);
+            index += olength - scientific_exponent - 1;
+        }
+    } else {
+        int exponent = scientific_exponent < 0 ? -scientific_exponent : scientific_exponent;
+
+        result[index++] = digits[0];
+        if (olength > 1) {
+            result[index++] = '.';
+            memcpy(result + index, digits + 1, olength - 1);
+            index += olength - 1;
+        }
+        result[index++] = 'e';
+        result[index++] = scientific_exponent < 0 ? '-' : '+';
+        if (exponent >= 100) {
+            result[index++] = (char) ('0' + exponent / 100);
+            exponent %= 100;
+        }
+        result[index++] = (char) ('0' + exponent / 10);
+        result[index++] = (char) ('0' + exponent % 10);
+    }
+
+    result[index] = '\0';
+    return index;
+}
+
+/*
+ * Implementation.
+ */
+
+int ryu_double_to_chars(double value, char *result) {
+    uint64 bits;
+    bool sign;
+    uint64 ieeeMantissa;
+    uint32 ieeeExponent;
+    DecimalFloat v;
+
+    memcpy(&bits, &value, sizeof(double));
+
+    sign = ((bits >> (DOUBLE_MANTISSA_BITS + DOUBLE_EXPONENT_BITS)) & 1) != 0;
+    ieeeMantissa = bits & ((UINT64CONST(1) << DOUBLE_MANTISSA_BITS) - 1);
+    ieeeExponent = (uint32) ((bits >> DOUBLE_MANTISSA_BITS) & ((1u << DOUBLE_EXPONENT_BITS) - 1));
+
+    if (ieeeExponent == ((1u << DOUBLE_EXPONENT_BITS) - 1)) {
+        return copy_special(result, sign, ieeeMantissa != 0);
+    }
+
+    if (ieeeExponent == 0 && ieeeMantissa == 0) {
+        v.mantissa = 0;
+        v.exponent = 0;
+    } else {
+        v = double_to_decimal(ieeeMantissa, ieeeExponent);
+    }
+
+    return format_decimal(v, sign, DOUBLE_FIXED_MAX_EXPONENT, result);
+}
+
+int ryu_float_to_chars(float value, char *result) {
+    uint32 bits;
+    bool sign;
+    uint32 ieeeMantissa;
+    uint32 ieeeExponent;
+    DecimalFloat v;
+
+    memcpy(&bits, &value, sizeof(float));
+
+    sign = ((bits >> (FLOAT_MANTISSA_BITS + FLOAT_EXPONENT_BITS)) & 1) != 0;
+    ieeeMantissa = bits & ((1u << FLOAT_MANTISSA_BITS) - 1);
+    ieeeExponent = (bits >> FLOAT_MANTISSA_BITS) & ((1u << FLOAT_EXPONENT_BITS) - 1);
+
+    if (ieeeExponent == ((1u << FLOAT_EXPONENT_BITS) - 1)) {
+        return copy_special(result, sign, ieeeMantissa != 0);
+    }
+
+    if (ieeeExponent == 0 && ieeeMantissa == 0) {
+        v.mantissa = 0;
+        v.exponent = 0;
+    } else {
+        v = float_to_decimal(ieeeMantissa, ieeeExponent);
+    }
+
+    return format_decimal(v, sign, FLOAT_FIXED_MAX_EXPONENT, result);
+}
@@ -0,0 +1,18 @@
+#ifndef RYU_H
+#define RYU_H
+
+/*
+ * Shortest round-trip decimal conversion of float4/float8 (Ryu), formatted
+ * the way float4out/float8out do on PostgreSQL 12+ with the default
+ * extra_float_digits, independently of the server version and settings.
+ *
+ * The result is NUL-terminated; the return value is its length.
+ */
+#define RYU_DOUBLE_BUFLEN 25
+#define RYU_FLOAT_BUFLEN 16
+
+extern int ryu_double_to_chars(double value, char *result);
+
+extern int ryu_float_to_chars(float value, char *result);
+
+#endif
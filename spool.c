@@ -0,0 +1,461 @@
+/*
+ * Spool writer: a background worker that consumes a replication slot of this
+ * plugin on the server itself and writes the changes to NDJSON segment files.
+ *
+ * It is registered at postmaster start when the library is in
+ * shared_preload_libraries and json_decoding.spool_slot is set. It decodes
+ * the slot with the plugin, exactly as pg_logical_slot_get_changes would,
+ * and appends every message as a line to the current segment,
+ * <directory>/<LSN>.ndjson. Segments are rotated at record boundaries once
+ * they reach json_decoding.spool_segment_size.
+ *
+ * A segment is named after the WAL record being decoded when its first
+ * message was written; for changes that is their transaction's commit
+ * record, not the change's own LSN, which goes back whenever a transaction
+ * that started earlier commits later. Records are decoded in WAL order, so
+ * segment names increase and sorting them by name gives the order the
+ * messages were written in.
+ *
+ * Writes are fsynced in batches: after json_decoding.spool_fsync_interval,
+ * when a segment is rotated and whenever the worker has caught up with the
+ * WAL. Only after a fsync is the slot's flush position confirmed, so a
+ * restart never loses a change but may write again the ones decoded since
+ * the last fsync.
+ */
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "access/xlog.h"
+#include "access/xlogreader.h"
+#include "access/xlogutils.h"
+
+#include "miscadmin.h"
+
+#include "nodes/makefuncs.h"
+
+#include "pgstat.h"
+
+#include "postmaster/bgworker.h"
+
+#include "replication/logical.h"
+#include "replication/logicalfuncs.h"
+#include "replication/slot.h"
+
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+
+#include "tcop/tcopprot.h"
+
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+
+#include "json_decoding_internal.h"
+
+/* how long to sleep when the worker has caught up with the WAL */
+#define SPOOL_NAPTIME_MS 200
+
+/* output is written to the segment in pieces of this size */
+#define SPOOL_WRITE_BYTES (64 * 1024)
+
+typedef struct {
+    int fd;
+    char path[MAXPGPATH];
+    bool synced_directory;
+    int64 segment_bytes;
+    int64 unsynced_bytes;
+    TimestampTz last_fsync;
+    StringInfoData buffer;
+} SpoolState;
+
+static char *spool_slot = NULL;
+static char *spool_database = NULL;
+static char *spool_directory = NULL;
+static char *spool_options = NULL;
+static int spool_segment_size = 64;
+static int spool_fsync_interval = 1000;
+
+static SpoolState spool;
+
+PGDLLEXPORT void json_decoding_spool_main(Datum main_arg);
+
+/*
+ * Helper Methods.
+ */
+static List *spool_parse_options(void);
+
+static void spool_prepare_write(LogicalDecodingContext *ctx,
+                                XLogRecPtr lsn,
+                                TransactionId xid,
+                                bool last_write);
+
+static void spool_write(LogicalDecodingContext *ctx,
+                        XLogRecPtr lsn,
+                        TransactionId xid,
+                        bool last_write);
+
+static void spool_write_buffer(void);
+
+static void spool_fsync(XLogRecPtr confirm_lsn, bool close_segment);
+
+/*
+ * Implementation.
+ */
+
+void spool_init(void) {
+    BackgroundWorker worker;
+
+    DefineCustomStringVariable("json_decoding.spool_slot",
+                               "Replication slot the spool writer consumes; empty disables it.",
+                               NULL,
+                               &spool_slot,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomStringVariable("json_decoding.spool_database",
+                               "Database of the spool writer's replication slot.",
+                               NULL,
+                               &spool_database,
+                               "postgres",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomStringVariable("json_decoding.spool_directory",
+                               "Directory the spool writer writes its segments to.",
+                               "Relative paths are relative to the data directory.",
+                               &spool_directory,
+                               "json_decoding_spool",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomStringVariable("json_decoding.spool_options",
+                               "Plugin options of the spool writer, as name=value pairs separated by commas.",
+                               NULL,
+                               &spool_options,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomIntVariable("json_decoding.spool_segment_size",
+                            "Size at which the spool writer starts a new segment.",
+                            NULL,
+                            &spool_segment_size,
+                            64,
+                            1,
+                            1024 * 1024,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_MB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("json_decoding.spool_fsync_interval",
+                            "Longest time the spool writer leaves written changes unsynced.",
+                            NULL,
+                            &spool_fsync_interval,
+                            1000,
+                            0,
+                            INT_MAX,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress || spool_slot[0] == '\0') {
+        return;
+    }
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "json_decoding");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "json_decoding_spool_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "json_decoding spool writer");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "json_decoding spool writer");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+void json_decoding_spool_main(Datum main_arg) {
+    LogicalDecodingContext *ctx;
+    JsonDecodingData *data;
+    XLogRecPtr end_of_wal;
+    XLogRecord *record;
+    char *errm = NULL;
+    bool progress;
+#if PG_VERSION_NUM < 130000
+    XLogRecPtr startptr;
+#endif
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    BackgroundWorkerInitializeConnection(spool_database, NULL, 0);
+    CreateAuxProcessResourceOwner();
+
+    if (MakePGDirectory(spool_directory) < 0 && errno != EEXIST) {
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                        errmsg("could not create directory \"%s\": %m", spool_directory)));
+    }
+
+    spool.fd = -1;
+    spool.last_fsync = GetCurrentTimestamp();
+    initStringInfo(&spool.buffer);
+
+    CheckLogicalDecodingRequirements();
+
+#if PG_VERSION_NUM >= 140000
+    ReplicationSlotAcquire(spool_slot, true);
+#elif PG_VERSION_NUM >= 130000
+    ReplicationSlotAcquire(spool_slot, SAB_Error);
+#else
+    ReplicationSlotAcquire(spool_slot, true);
+#endif
+
+    if (strcmp(NameStr(MyReplicationSlot->data.plugin), "json_decoding") != 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                        errmsg("replication slot \"%s\" does not use the json_decoding plugin", spool_slot)));
+    }
+
+    ctx = CreateDecodingContext(InvalidXLogRecPtr,
+                                spool_parse_options(),
+                                false,
+#if PG_VERSION_NUM >= 130000
+                                XL_ROUTINE(.page_read = read_local_xlog_page,
+                                           .segment_open = wal_segment_open,
+                                           .segment_close = wal_segment_close),
+#else
+                                logical_read_local_xlog_page,
+#endif
+                                spool_prepare_write,
+                                spool_write,
+                                NULL);
+
+    data = ctx->output_plugin_private;
+    if (data->format != FORMAT_JSON || data->compression != COMPRESSION_NONE) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("only format=json without compression is supported by the spool writer")));
+    }
+
+    ereport(LOG,
+            (errmsg("json_decoding spool writer consuming slot \"%s\" from %X/%X",
+                    spool_slot,
+                    (uint32) (MyReplicationSlot->data.confirmed_flush >> 32),
+                    (uint32) MyReplicationSlot->data.confirmed_flush)));
+
+#if PG_VERSION_NUM >= 130000
+    XLogBeginRead(ctx->reader, MyReplicationSlot->data.restart_lsn);
+#else
+    startptr = MyReplicationSlot->data.restart_lsn;
+#endif
+
+    for (;;) {
+#if PG_VERSION_NUM >= 150000
+        end_of_wal = GetFlushRecPtr(NULL);
+#else
+        end_of_wal = GetFlushRecPtr();
+#endif
+        progress = false;
+
+        /* decode up to what is flushed, like pg_logical_slot_get_changes */
+#if PG_VERSION_NUM >= 130000
+        while (ctx->reader->EndRecPtr < end_of_wal) {
+            record = XLogReadRecord(ctx->reader, &errm);
+#else
+        while ((startptr != InvalidXLogRecPtr && startptr < end_of_wal) ||
+               (ctx->reader->EndRecPtr != InvalidXLogRecPtr && ctx->reader->EndRecPtr < end_of_wal)) {
+            record = XLogReadRecord(ctx->reader, startptr, &errm);
+            startptr = InvalidXLogRecPtr;
+#endif
+            if (errm != NULL) {
+                elog(ERROR, "%s", errm);
+            }
+
+            if (record != NULL) {
+                LogicalDecodingProcessRecord(ctx, ctx->reader);
+            }
+            progress = true;
+
+            if (spool.segment_bytes >= (int64) spool_segment_size * 1024 * 1024) {
+                spool_fsync(ctx->reader->EndRecPtr, true);
+            } else if (spool.unsynced_bytes > 0 &&
+                       TimestampDifferenceExceeds(spool.last_fsync, GetCurrentTimestamp(), spool_fsync_interval)) {
+                spool_fsync(ctx->reader->EndRecPtr, false);
+            }
+
+            CHECK_FOR_INTERRUPTS();
+        }
+
+        /* caught up: make everything durable and confirm it */
+        spool_fsync(ctx->reader->EndRecPtr, false);
+
+        if (!progress) {
+#if PG_VERSION_NUM >= 120000
+            (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, SPOOL_NAPTIME_MS,
+                             PG_WAIT_EXTENSION);
+#else
+            if (WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, SPOOL_NAPTIME_MS,
+                          PG_WAIT_EXTENSION) & WL_POSTMASTER_DEATH) {
+                proc_exit(1);
+            }
+#endif
+            ResetLatch(MyLatch);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/*
+ * Helper Implementations.
+ */
+
+/*
+ * json_decoding.spool_options as the option list of the plugin; a name
+ * without a value is a boolean set to true.
+ */
+static List *spool_parse_options(void) {
+    List *options = NIL;
+    char *rawstring = pstrdup(spool_options);
+    char *item;
+    char *value;
+
+    for (item = strtok(rawstring, ","); item != NULL; item = strtok(NULL, ",")) {
+        while (*item == ' ') {
+            item++;
+        }
+        if (*item == '\0') {
+            continue;
+        }
+
+        value = strchr(item, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        }
+
+        options = lappend(options, makeDefElem(pstrdup(item),
+                                               (Node *) makeString(pstrdup(value != NULL ? value : "true")),
+                                               -1));
+    }
+
+    return options;
+}
+
+static void spool_prepare_write(LogicalDecodingContext *ctx,
+                                XLogRecPtr lsn,
+                                TransactionId xid,
+                                bool last_write) {
+    resetStringInfo(ctx->out);
+}
+
+/*
+ * A message is a line of the current segment, which is opened by its first
+ * message. Values are escaped JSON, but a registered type formatter may
+ * still write newlines; in valid JSON they can only be whitespace, so they
+ * become spaces.
+ */
+static void spool_write(LogicalDecodingContext *ctx,
+                        XLogRecPtr lsn,
+                        TransactionId xid,
+                        bool last_write) {
+    char *end;
+    char *c;
+
+    if (spool.fd < 0) {
+        XLogRecPtr position = ctx->reader->ReadRecPtr;
+
+        snprintf(spool.path, MAXPGPATH, "%s/%08X%08X.ndjson", spool_directory,
+                 (uint32) (position >> 32), (uint32) position);
+
+        spool.fd = BasicOpenFile(spool.path, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY);
+        if (spool.fd < 0) {
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                            errmsg("could not open file \"%s\": %m", spool.path)));
+        }
+
+        spool.synced_directory = false;
+        spool.segment_bytes = 0;
+    }
+
+    appendBinaryStringInfo(&spool.buffer, ctx->out->data, ctx->out->len);
+
+    end = spool.buffer.data + spool.buffer.len;
+    for (c = memchr(end - ctx->out->len, '\n', ctx->out->len); c != NULL; c = memchr(c + 1, '\n', end - c - 1)) {
+        *c = ' ';
+    }
+
+    appendStringInfoChar(&spool.buffer, '\n');
+
+    spool.segment_bytes += ctx->out->len + 1;
+    spool.unsynced_bytes += ctx->out->len + 1;
+
+    if (spool.buffer.len >= SPOOL_WRITE_BYTES) {
+        spool_write_buffer();
+    }
+}
+
+static void spool_write_buffer(void) {
+    int written = 0;
+    int rc;
+
+    while (written < spool.buffer.len) {
+        errno = 0;
+        rc = write(spool.fd, spool.buffer.data + written, spool.buffer.len - written);
+        if (rc <= 0) {
+            /* a short write without an error is out of disk space */
+            if (errno == 0) {
+                errno = ENOSPC;
+            }
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                            errmsg("could not write to file \"%s\": %m", spool.path)));
+        }
+        written += rc;
+    }
+
+    resetStringInfo(&spool.buffer);
+}
+
+/*
+ * Write out and fsync the segment, then confirm everything decoded so far.
+ * A new segment's directory entry is synced once, with its first fsync.
+ */
+static void spool_fsync(XLogRecPtr confirm_lsn, bool close_segment) {
+    if (spool.fd >= 0) {
+        spool_write_buffer();
+
+        if (spool.unsynced_bytes > 0 && pg_fsync(spool.fd) != 0) {
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                            errmsg("could not fsync file \"%s\": %m", spool.path)));
+        }
+
+        if (!spool.synced_directory) {
+            fsync_fname(spool_directory, true);
+            spool.synced_directory = true;
+        }
+
+        if (close_segment) {
+            close(spool.fd);
+            spool.fd = -1;
+        }
+    }
+
+    spool.unsynced_bytes = 0;
+    spool.last_fsync = GetCurrentTimestamp();
+
+    if (confirm_lsn != InvalidXLogRecPtr && confirm_lsn > MyReplicationSlot->data.confirmed_flush) {
+        LogicalConfirmReceivedLocation(confirm_lsn);
+    }
+}
@@ -0,0 +1,497 @@
+/*
+ * Per-slot statistics (pg_stat_json_decoding).
+ *
+ * With the library in shared_preload_libraries, every slot decoded with the
+ * plugin gets an entry in shared memory, found by slot name when decoding
+ * starts. There are max_replication_slots entries; when they are all taken,
+ * the entry of a slot that no longer exists is reused.
+ *
+ * Decoding counts into JsonDecodingData and adds the counts to the entry at
+ * every commit and at shutdown, so a change costs no shared memory access.
+ * The entries are read by json_decoding_stats and json_decoding_histograms,
+ * behind the views, and zeroed by json_decoding_stats_reset. Each entry has
+ * an LWLock of its own rather than a spinlock, since publishing and reading
+ * loop over the histograms.
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "replication/slot.h"
+
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "json_decoding_internal.h"
+
+#define STATS_COLUMNS 16
+
+#define HISTOGRAM_COLUMNS 5
+
+typedef struct {
+    LWLock *lock;
+    bool in_use;
+    NameData slot_name;
+    JsonDecodingCounters counters;
+    TimestampTz stats_reset;
+} JsonDecodingStatsEntry;
+
+typedef struct {
+    LWLock *lock;
+    int nentries;
+    JsonDecodingStatsEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} JsonDecodingStatsShared;
+
+static JsonDecodingStatsShared *stats_shared = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+PG_FUNCTION_INFO_V1(json_decoding_stats);
+
+PG_FUNCTION_INFO_V1(json_decoding_stats_reset);
+
+PG_FUNCTION_INFO_V1(json_decoding_histograms);
+
+/*
+ * Helper Methods.
+ */
+static Size stats_shmem_size(void);
+
+static void stats_shmem_request(void);
+
+static void stats_shmem_startup(void);
+
+static bool slot_exists(const char *name);
+
+static void check_stats_available(void);
+
+static Tuplestorestate *materialize_result(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
+static void put_histogram(Tuplestorestate *tupstore,
+                          TupleDesc tupdesc,
+                          Name slot_name,
+                          const char *histogram,
+                          int64 *counts);
+
+static int histogram_bucket(uint64 value);
+
+static uint64 histogram_lower_bound(int bucket);
+
+/*
+ * Implementation.
+ */
+
+void stats_init(void) {
+    if (!process_shared_preload_libraries_in_progress) {
+        return;
+    }
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = stats_shmem_request;
+#else
+    stats_shmem_request();
+#endif
+
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = stats_shmem_startup;
+}
+
+/*
+ * Find or take the entry of the slot being decoded, if there is one.
+ */
+void stats_attach(JsonDecodingData *data) {
+    const char *name;
+    int free_index = -1;
+    int i;
+
+    data->track_stats = false;
+
+    if (stats_shared == NULL || MyReplicationSlot == NULL) {
+        return;
+    }
+
+    name = NameStr(MyReplicationSlot->data.name);
+
+    LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < stats_shared->nentries; i++) {
+        JsonDecodingStatsEntry *entry = &stats_shared->entries[i];
+
+        if (entry->in_use && strcmp(NameStr(entry->slot_name), name) == 0) {
+            break;
+        }
+        if (!entry->in_use && free_index < 0) {
+            free_index = i;
+        }
+    }
+
+    if (i == stats_shared->nentries) {
+        /* all taken: reuse the entry of a dropped slot */
+        for (i = 0; free_index < 0 && i < stats_shared->nentries; i++) {
+            if (!slot_exists(NameStr(stats_shared->entries[i].slot_name))) {
+                free_index = i;
+            }
+        }
+
+        if (free_index >= 0) {
+            JsonDecodingStatsEntry *entry = &stats_shared->entries[free_index];
+
+            LWLockAcquire(entry->lock, LW_EXCLUSIVE);
+            entry->in_use = true;
+            namestrcpy(&entry->slot_name, name);
+            memset(&entry->counters, 0, sizeof(JsonDecodingCounters));
+            entry->stats_reset = GetCurrentTimestamp();
+            LWLockRelease(entry->lock);
+        }
+        i = free_index;
+    }
+
+    LWLockRelease(stats_shared->lock);
+
+    if (i >= 0) {
+        data->track_stats = true;
+        data->stats_index = i;
+        memset(&data->counters, 0, sizeof(JsonDecodingCounters));
+        INSTR_TIME_SET_ZERO(data->serialize_time);
+    }
+}
+
+/*
+ * Add the counts since the last call to the slot's entry.
+ */
+void stats_publish(JsonDecodingData *data) {
+    JsonDecodingStatsEntry *entry;
+    JsonDecodingCounters *counters = &data->counters;
+    int i;
+
+    if (!data->track_stats) {
+        return;
+    }
+
+    counters->serialize_time = INSTR_TIME_GET_MICROSEC(data->serialize_time);
+    entry = &stats_shared->entries[data->stats_index];
+
+    LWLockAcquire(entry->lock, LW_EXCLUSIVE);
+    entry->counters.inserts += counters->inserts;
+    entry->counters.updates += counters->updates;
+    entry->counters.deletes += counters->deletes;
+    entry->counters.truncates += counters->truncates;
+    entry->counters.messages += counters->messages;
+    entry->counters.transactions += counters->transactions;
+    entry->counters.filtered += counters->filtered;
+    entry->counters.bytes += counters->bytes;
+    entry->counters.max_message_bytes = Max(entry->counters.max_message_bytes, counters->max_message_bytes);
+    entry->counters.serialize_time += counters->serialize_time;
+    entry->counters.detoasted += counters->detoasted;
+    entry->counters.detoasted_bytes += counters->detoasted_bytes;
+    if (counters->transactions > 0) {
+        entry->counters.decode_lag = counters->decode_lag;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        entry->counters.change_time_histogram[i] += counters->change_time_histogram[i];
+        entry->counters.message_size_histogram[i] += counters->message_size_histogram[i];
+    }
+    LWLockRelease(entry->lock);
+
+    memset(counters, 0, sizeof(JsonDecodingCounters));
+    INSTR_TIME_SET_ZERO(data->serialize_time);
+}
+
+Datum json_decoding_stats(PG_FUNCTION_ARGS) {
+    Tuplestorestate *tupstore;
+    TupleDesc tupdesc;
+    int i;
+
+    check_stats_available();
+    tupstore = materialize_result(fcinfo, &tupdesc);
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+    for (i = 0; i < stats_shared->nentries; i++) {
+        JsonDecodingStatsEntry *entry = &stats_shared->entries[i];
+        JsonDecodingCounters counters;
+        TimestampTz stats_reset;
+        NameData slot_name;
+        Datum values[STATS_COLUMNS];
+        bool nulls[STATS_COLUMNS];
+        int n = 0;
+
+        if (!entry->in_use) {
+            continue;
+        }
+
+        LWLockAcquire(entry->lock, LW_SHARED);
+        slot_name = entry->slot_name;
+        counters = entry->counters;
+        stats_reset = entry->stats_reset;
+        LWLockRelease(entry->lock);
+
+        memset(nulls, 0, sizeof(nulls));
+        values[n++] = NameGetDatum(&slot_name);
+        values[n++] = Int64GetDatum(counters.inserts);
+        values[n++] = Int64GetDatum(counters.updates);
+        values[n++] = Int64GetDatum(counters.deletes);
+        values[n++] = Int64GetDatum(counters.truncates);
+        values[n++] = Int64GetDatum(counters.messages);
+        values[n++] = Int64GetDatum(counters.transactions);
+        values[n++] = Int64GetDatum(counters.filtered);
+        values[n++] = Int64GetDatum(counters.bytes);
+        values[n++] = Int64GetDatum(counters.max_message_bytes);
+        values[n++] = Float8GetDatum(counters.serialize_time / 1000.0);
+        values[n++] = Int64GetDatum(counters.detoasted);
+        values[n++] = Int64GetDatum(counters.detoasted_bytes);
+        values[n++] = Int64GetDatum(counters.decode_lag);
+        values[n++] = BoolGetDatum(slot_exists(NameStr(slot_name)));
+        values[n++] = TimestampTzGetDatum(stats_reset);
+        Assert(n == STATS_COLUMNS);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    LWLockRelease(stats_shared->lock);
+
+    return (Datum) 0;
+}
+
+/*
+ * The non-empty buckets of every slot's histograms, with their bounds; the
+ * upper bound is exclusive, and null for the last bucket.
+ */
+Datum json_decoding_histograms(PG_FUNCTION_ARGS) {
+    Tuplestorestate *tupstore;
+    TupleDesc tupdesc;
+    JsonDecodingCounters *counters = palloc(sizeof(JsonDecodingCounters));
+    NameData slot_name;
+    int i;
+
+    check_stats_available();
+    tupstore = materialize_result(fcinfo, &tupdesc);
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+    for (i = 0; i < stats_shared->nentries; i++) {
+        JsonDecodingStatsEntry *entry = &stats_shared->entries[i];
+
+        if (!entry->in_use) {
+            continue;
+        }
+
+        LWLockAcquire(entry->lock, LW_SHARED);
+        slot_name = entry->slot_name;
+        memcpy(counters, &entry->counters, sizeof(JsonDecodingCounters));
+        LWLockRelease(entry->lock);
+
+        put_histogram(tupstore, tupdesc, &slot_name, "change_time", counters->change_time_histogram);
+        put_histogram(tupstore, tupdesc, &slot_name, "message_size", counters->message_size_histogram);
+    }
+
+    LWLockRelease(stats_shared->lock);
+
+    pfree(counters);
+
+    return (Datum) 0;
+}
+
+void stats_histogram_add(int64 *histogram, uint64 value) {
+    histogram[histogram_bucket(value)]++;
+}
+
+/*
+ * Zero the counters of one slot, or of every slot when it is null.
+ */
+Datum json_decoding_stats_reset(PG_FUNCTION_ARGS) {
+    Name slot_name = PG_ARGISNULL(0) ? NULL : PG_GETARG_NAME(0);
+    TimestampTz now = GetCurrentTimestamp();
+    int i;
+
+    check_stats_available();
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+    for (i = 0; i < stats_shared->nentries; i++) {
+        JsonDecodingStatsEntry *entry = &stats_shared->entries[i];
+
+        if (!entry->in_use) {
+            continue;
+        }
+
+        LWLockAcquire(entry->lock, LW_EXCLUSIVE);
+        if (slot_name == NULL || strcmp(NameStr(entry->slot_name), NameStr(*slot_name)) == 0) {
+            memset(&entry->counters, 0, sizeof(JsonDecodingCounters));
+            entry->stats_reset = now;
+        }
+        LWLockRelease(entry->lock);
+    }
+
+    LWLockRelease(stats_shared->lock);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Helper Implementations.
+ */
+
+static Size stats_shmem_size(void) {
+    return add_size(offsetof(JsonDecodingStatsShared, entries),
+                    mul_size(Max(max_replication_slots, 1), sizeof(JsonDecodingStatsEntry)));
+}
+
+static void stats_shmem_request(void) {
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook != NULL) {
+        prev_shmem_request_hook();
+    }
+#endif
+
+    RequestAddinShmemSpace(stats_shmem_size());
+    /* one for the entry table, one per entry */
+    RequestNamedLWLockTranche("json_decoding", 1 + Max(max_replication_slots, 1));
+}
+
+static void stats_shmem_startup(void) {
+    bool found;
+    int i;
+
+    if (prev_shmem_startup_hook != NULL) {
+        prev_shmem_startup_hook();
+    }
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    stats_shared = ShmemInitStruct("json_decoding stats", stats_shmem_size(), &found);
+    if (!found) {
+        LWLockPadded *locks = GetNamedLWLockTranche("json_decoding");
+
+        stats_shared->lock = &locks[0].lock;
+        stats_shared->nentries = Max(max_replication_slots, 1);
+
+        for (i = 0; i < stats_shared->nentries; i++) {
+            stats_shared->entries[i].lock = &locks[i + 1].lock;
+            stats_shared->entries[i].in_use = false;
+        }
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+static bool slot_exists(const char *name) {
+    bool found = false;
+    int i;
+
+    LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+
+    for (i = 0; i < max_replication_slots; i++) {
+        ReplicationSlot *slot = &ReplicationSlotCtl->replication_slots[i];
+
+        if (slot->in_use && strcmp(NameStr(slot->data.name), name) == 0) {
+            found = true;
+            break;
+        }
+    }
+
+    LWLockRelease(ReplicationSlotControlLock);
+
+    return found;
+}
+
+static Tuplestorestate *materialize_result(FunctionCallInfo fcinfo, TupleDesc *tupdesc) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Tuplestorestate *tupstore;
+    MemoryContext old;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || (rsinfo->allowedModes & SFRM_Materialize) == 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("set-valued function called in context that cannot accept a set")));
+    }
+
+    if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE) {
+        elog(ERROR, "return type must be a row type");
+    }
+
+    old = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+    *tupdesc = CreateTupleDescCopy(*tupdesc);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = *tupdesc;
+
+    MemoryContextSwitchTo(old);
+
+    return tupstore;
+}
+
+static void put_histogram(Tuplestorestate *tupstore,
+                          TupleDesc tupdesc,
+                          Name slot_name,
+                          const char *histogram,
+                          int64 *counts) {
+    Datum values[HISTOGRAM_COLUMNS];
+    bool nulls[HISTOGRAM_COLUMNS];
+    int bucket;
+
+    for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (counts[bucket] == 0) {
+            continue;
+        }
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = NameGetDatum(slot_name);
+        values[1] = CStringGetTextDatum(histogram);
+        values[2] = Int64GetDatum((int64) histogram_lower_bound(bucket));
+        if (bucket < HISTOGRAM_BUCKETS - 1) {
+            values[3] = Int64GetDatum((int64) histogram_lower_bound(bucket + 1));
+        } else {
+            nulls[3] = true;
+        }
+        values[4] = Int64GetDatum(counts[bucket]);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+}
+
+/*
+ * Values below 4 have a bucket each; from there, a value in [2^e, 2^(e+1))
+ * is in one of the four buckets of e, chosen by its two bits below the top.
+ */
+static int histogram_bucket(uint64 value) {
+    int exponent = 2;
+
+    if (value < 4) {
+        return (int) value;
+    }
+
+    while ((value >> exponent) > 1) {
+        exponent++;
+    }
+
+    return Min(4 * (exponent - 1) + (int) ((value >> (exponent - 2)) & 3), HISTOGRAM_BUCKETS - 1);
+}
+
+static uint64 histogram_lower_bound(int bucket) {
+    if (bucket < 4) {
+        return (uint64) bucket;
+    }
+
+    return (uint64) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void check_stats_available(void) {
+    if (stats_shared == NULL) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                        errmsg("json_decoding must be loaded via shared_preload_libraries")));
+    }
+}